@@ -1,384 +1,6061 @@
-#pragma once
-
-#include <string>
-#include <string_view>
-#include <vector>
-#include <functional>
-#include <fstream>
-#include <iostream>
-#include <optional>
-
-namespace Gllpp {
-	class Trampoline;
-	template<typename LT, typename RT>
-	class Sequence;
-	template<typename LT, typename RT>
-	class Disjunction;
-
-
-
-
-
-	struct ParserResult {
-		std::string_view trail;
-		std::optional<std::string> error;
-
-		bool is_success() const {
-			return !error;
-		}
-
-		bool operator<(const ParserResult& other) const {
-			return trail.size() < other.trail.size();
-		}
-	};
-
-
-
-
-
-
-	class Trampoline {
-	public:
-		Trampoline(std::string_view str)
-			: _str(str) {
-		}
-
-		void add(std::function<void(Trampoline&)> f) {
-			Work work;
-			work.f = f;
-
-			_work.push_back(work);
-		}
-
-		void run() {
-			while (!_work.empty()) {
-				auto work = _work.back();
-				_work.pop_back();
-
-				work.f(*this);
-			}
-		}
-
-	private:
-		struct Work {
-			std::function<void(Trampoline&)> f;
-		};
-
-		std::vector<Work> _work;
-		std::string_view _str;
-	};
-
-
-
-
-	class ParserBase {
-	};
-
-	template<typename T>
-	class ComposableParser : public ParserBase {
-	public:
-		/// Match str with contained grammar. Return either a list of successes or failures.
-		std::vector<ParserResult> parse(std::string str) const {
-			Trampoline trampoline{ str };
-			std::vector<ParserResult> successes, failures;
-
-			static_cast<const T*>(this)->_chain(trampoline, {}, str, [&](Trampoline& trampoline, ParserResult result) {
-				if (!result.trail.empty()) {
-					ParserResult actualResult{ result.trail, "Tail left" };
-					if (successes.empty()) {
-						failures.push_back(actualResult);
-					}
-				}
-				else if (result.is_success()) {
-					successes.push_back(result);
-					failures.clear();
-				}
-				else if (successes.empty()) {
-					failures.push_back(result);
-				}
-			});
-
-			trampoline.run();
-
-			return !successes.empty() ? successes : failures;
-		}
-
-		template<typename F>
-		void _gather(F f) const {
-			f(*static_cast<const T*>(this));
-		}
-
-		template<typename OtherT>
-		Sequence<T, OtherT> operator+(OtherT other) const {
-			return { *static_cast<const T*>(this), other };
-		}
-
-		template<typename OtherT>
-		Disjunction<T, OtherT> operator|(OtherT other) const {
-			return { *static_cast<const T*>(this), other };
-		}
-
-	protected:
-		static void skip_layout(std::string_view layout, std::string_view& str) {
-			size_t i = 0;
-			for (; i < str.size(); ++i) {
-				if (layout.find_first_of(str[i]) == std::string::npos)
-					break;
-			}
-
-			str = str.substr(i);
-		}
-	};
-
-	class Parser : public ComposableParser<Parser> {
-	public:
-		Parser()
-			: _wrapper(std::make_shared<SharedWrapper>()) {
-		}
-
-		template<typename P>
-		Parser(P p)
-			: Parser() {
-			*this = p;
-		}
-
-		template<typename P>
-		Parser& operator=(P p) {
-			static_assert(std::is_base_of_v<ParserBase, P>);
-			_wrapper->wrapper = std::make_unique<WrapperInstance<P>>(p);
-			return *this;
-		}
-
-		template<typename F>
-		void _chain(Trampoline& trampoline, std::string_view layout, std::string_view str, F f) const {
-			if (_wrapper->wrapper == nullptr) {
-				f(trampoline, ParserResult{ str, "Parser is null" });
-				return;
-			}
-
-			_wrapper->wrapper->chain(trampoline, layout, str, f);
-		}
-
-	private:
-		class IWrapper {
-		public:
-			virtual ~IWrapper() = default;
-
-			virtual void chain(Trampoline& trampoline, const std::string_view layout, std::string_view str, std::function<void(Trampoline&, ParserResult)> f) const = 0;
-		};
-
-		template<typename P>
-		class WrapperInstance final : public IWrapper {
-		public:
-			WrapperInstance(P p)
-				: _parser(p) {
-			}
-
-			virtual void chain(Trampoline& trampoline, std::string_view layout, std::string_view str, std::function<void(Trampoline&, ParserResult)> f) const override {
-				_parser._chain(trampoline, layout, str, f);
-			}
-
-		private:
-			P _parser;
-		};
-
-		struct SharedWrapper {
-			std::unique_ptr<IWrapper> wrapper;
-		};
-
-		std::shared_ptr<SharedWrapper> _wrapper;
-	};
-
-
-	template<typename P>
-	class Layout : public ComposableParser<Layout<P>> {
-	public:
-		Layout(P p, std::string layout)
-			: _p(p)
-			, _layout(layout) {
-			static_assert(std::is_base_of_v<ParserBase, P>);
-		}
-
-		template<typename F>
-		void _chain(Trampoline& trampoline, const std::string_view layout, std::string_view str, F f) const {
-			(void)layout;
-			_p._chain(trampoline, _layout, str, f);
-		}
-
-	private:
-		P _p;
-		std::string _layout;
-	};
-
-
-	/// Set layout for all parsers inside the passed Parser p. Layout is a list of chars which are automatically removed after every Parser.
-	template<typename P>
-	Layout<P> layout(P p, std::string definition) {
-		static_assert(std::is_base_of_v<ParserBase, P>);
-		return { p, definition };
-	}
-
-
-
-	class Empty : public ComposableParser<Empty> {
-	public:
-		template<typename F>
-		void _chain(Trampoline& trampoline, const std::string_view layout, std::string_view str, F f) const {
-			f(trampoline, ParserResult{ str });
-		}
-	};
-
-
-
-
-	namespace {
-		template<char DELIMITER, char... TRAIL>
-		struct CaptureDelimiterUtil {
-			static bool equals(char c) {
-				if (c == DELIMITER)
-					return true;
-
-				return CaptureDelimiterUtil<TRAIL...>::equals(c);
-			}
-		};
-
-		template<char DELIMITER>
-		struct CaptureDelimiterUtil<DELIMITER> {
-			static bool equals(char c) {
-				return c == DELIMITER;
-			}
-		};
-	}
-
-	template<char... DELIMITERS>
-	class Capture : public ComposableParser<Capture<DELIMITERS...>> {
-	public:
-		template<typename F>
-		void _chain(Trampoline& trampoline, const std::string_view layout, std::string_view str, F f) const {
-			size_t numConsumed = 0;
-			for (; numConsumed < str.size(); ++numConsumed) {
-				const auto c = str[numConsumed];
-				if (CaptureDelimiterUtil<DELIMITERS...>::equals(c))
-					goto delimiter_found;
-			}
-
-		delimiter_found:
-			const auto value = str.substr(0, numConsumed);
-
-			if (value.empty()) {
-				f(trampoline, ParserResult{ str, "Capture empty value" });
-			}
-
-			str = str.substr(numConsumed);
-			skip_layout(layout, str);
-
-			f(trampoline, ParserResult{ str });
-			return;
-		}
-	};
-
-
-
-
-
-	class Terminal : public ComposableParser<Terminal> {
-	public:
-		Terminal(std::string what)
-			: _what(what) {
-		}
-
-		template<typename F>
-		void _chain(Trampoline& trampoline, const std::string_view layout, std::string_view str, F f) const {
-			if (str.size() < _what.size() || memcmp(str.data(), _what.data(), _what.size())) {
-				f(trampoline, ParserResult{ str, "Terminal missing " + _what });
-				return;
-			}
-
-			str = str.substr(_what.size());
-			skip_layout(layout, str);
-
-			f(trampoline, ParserResult{ str });
-		}
-
-	private:
-		std::string _what;
-	};
-
-
-
-
-
-	template<typename LT, typename RT>
-	class Sequence : public ComposableParser<Sequence<LT, RT>> {
-	public:
-		Sequence(LT lhs, RT rhs)
-			: _lhs(lhs)
-			, _rhs(rhs) {
-			static_assert(std::is_base_of_v<ParserBase, LT>);
-			static_assert(std::is_base_of_v<ParserBase, RT>);
-		}
-
-		template<typename F>
-		void _chain(Trampoline& trampoline, const std::string_view layout, std::string_view str, F f) const {
-			_lhs._chain(trampoline, layout, str, [layout, f, this](Trampoline& trampoline, ParserResult result) {
-				if (!result.is_success()) {
-					f(trampoline, result);
-				}
-				else {
-					_rhs._chain(trampoline, layout, result.trail, f);
-				}
-			});
-		}
-
-	private:
-		LT _lhs;
-		RT _rhs;
-	};
-
-
-
-
-	template<typename LT, typename RT>
-	class Disjunction : public ComposableParser<Disjunction<LT, RT>> {
-	public:
-		Disjunction(LT lhs, RT rhs)
-			: _lhs(lhs)
-			, _rhs(rhs) {
-			static_assert(std::is_base_of_v<ParserBase, LT>);
-			static_assert(std::is_base_of_v<ParserBase, RT>);
-		}
-
-		template<typename F>
-		void _chain(Trampoline& trampoline, std::string_view layout, std::string_view str, F f) const {
-			_gather([&](auto& parser) {
-				trampoline.add([str, layout, f, &parser](Trampoline& trampoline) {
-					parser._chain(trampoline, layout, str, f);
-				});
-			});
-		}
-
-		template<typename F>
-		void _gather(F f) const {
-			_lhs._gather(f);
-			_rhs._gather(f);
-		}
-
-	private:
-		LT _lhs;
-		RT _rhs;
-	};
-
-
-
-
-
-	Terminal operator ""_t(const char* str, size_t size) {
-		return std::string{ str, size };
-	}
-
-	template<typename P>
-	Disjunction<P, Empty> optional(P p) {
-		static_assert(std::is_base_of_v<ParserBase, P>);
-		return { p, Empty() };
-	}
-}
\ No newline at end of file
+#pragma once
+
+#include "MappedFile.h"
+#include "Regular.h"
+
+#include <cstddef>
+#include <cstring>
+#include <new>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <functional>
+#include <iterator>
+#include <fstream>
+#include <iostream>
+#include <optional>
+#include <set>
+#include <map>
+#include <unordered_map>
+#include <unordered_set>
+#include <list>
+#include <deque>
+#include <stdexcept>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <exception>
+#include <random>
+#include <chrono>
+#include <future>
+#include <limits>
+
+#if __cpp_impl_coroutine
+#include <coroutine>
+#endif
+
+namespace Gllpp {
+	class Trampoline;
+	template<typename LT, typename RT>
+	class Sequence;
+	template<typename LT, typename RT>
+	class Disjunction;
+	class RuleWalker;
+	class TokenParser;
+
+
+
+
+
+	struct ParserResult {
+		std::string_view trail;
+		std::optional<std::string> error;
+
+		bool is_success() const {
+			return !error;
+		}
+
+		bool operator<(const ParserResult& other) const {
+			return trail.size() < other.trail.size();
+		}
+	};
+
+	/// Results of ComposableParser::parse_file(), trails point into file.
+	struct FileParse {
+		MappedFile file;
+		std::vector<ParserResult> results;
+	};
+
+
+
+
+	/// One lexeme, offset and length are in bytes of the source.
+	struct Token {
+		uint32_t kind;
+		uint32_t offset;
+		uint32_t length;
+	};
+
+	/// Output of Lexer::tokenize. kinds holds one byte per token, which is the input token grammars run over.
+	struct TokenStream {
+		std::string_view source;
+		std::vector<Token> tokens;
+		std::string kinds;
+		/// Offset at which no token matched.
+		std::optional<size_t> error;
+
+		/// Source text starting at the token trail (a suffix of kinds) begins with.
+		std::string_view source_trail(std::string_view trail) const {
+			const auto index = kinds.size() - trail.size();
+			return source.substr(index < tokens.size() ? tokens[index].offset : source.size());
+		}
+	};
+
+
+
+
+
+
+	/// Order in which the Trampoline processes queued descriptors.
+	enum class Schedule {
+		/// Most recent first, i.e. depth-first.
+		LIFO,
+		/// Oldest first, i.e. breadth-first.
+		FIFO,
+		/// Lowest input position first, so the parse sweeps over the input once.
+		POSITION,
+		/// Furthest input position first, and at the same position the highest weight first, the most recent of equal
+		/// ones first. Alternatives weigh what the rule they start with and the rule they belong to weigh together
+		/// (see Parser::set_weight()). Follows the most promising branch before the doomed ones, so a first parse
+		/// (see ParseOptions::degrade_after) is found with few descriptors.
+		BEST_FIRST
+	};
+
+	/// Flag that stops the parses given a copy of it (see ParseOptions::cancellation) from any thread. Copies share
+	/// the flag.
+	class CancellationToken {
+	public:
+		void cancel() {
+			_cancelled->store(true, std::memory_order_relaxed);
+		}
+
+		bool cancelled() const {
+			return _cancelled->load(std::memory_order_relaxed);
+		}
+
+	private:
+		std::shared_ptr<std::atomic<bool>> _cancelled = std::make_shared<std::atomic<bool>>(false);
+	};
+
+	/// Thrown by a parse that was stopped before it was done, see ParseOptions. The parse is abandoned, a Trampoline
+	/// or ParseContext it ran in can only be reset.
+	class ParseStopped : public std::runtime_error {
+	public:
+		enum class Reason {
+			CANCELLED,
+			TIMEOUT,
+			/// The budgets of ParseOptions, see BudgetExceeded.
+			STEPS,
+			GSS_NODES,
+			RESULTS,
+			MEMORY
+		};
+
+		ParseStopped(Reason reason, size_t position)
+			: std::runtime_error(_message(reason))
+			, _reason(reason)
+			, _position(position) {
+		}
+
+		Reason reason() const {
+			return _reason;
+		}
+
+		/// Input position the parse was at: of the descriptor that would have run next, or of the GSS node or result
+		/// that went over a budget.
+		size_t position() const {
+			return _position;
+		}
+
+	private:
+		static const char* _message(Reason reason) {
+			switch (reason) {
+			case Reason::CANCELLED:
+				return "Gllpp: parse cancelled";
+			case Reason::TIMEOUT:
+				return "Gllpp: parse timed out";
+			case Reason::STEPS:
+				return "Gllpp: parse ran out of steps";
+			case Reason::GSS_NODES:
+				return "Gllpp: parse exceeded its GSS node budget";
+			case Reason::RESULTS:
+				return "Gllpp: parse exceeded its result budget";
+			default:
+				return "Gllpp: parse exceeded its memory budget";
+			}
+		}
+
+		Reason _reason;
+		size_t _position;
+	};
+
+	/// Thrown by a parse that went over one of the budgets of ParseOptions, as opposed to being cancelled or timing out.
+	class BudgetExceeded : public ParseStopped {
+	public:
+		BudgetExceeded(Reason reason, size_t position, size_t limit)
+			: ParseStopped(reason, position)
+			, _limit(limit) {
+		}
+
+		/// The budget that was exceeded.
+		size_t limit() const {
+			return _limit;
+		}
+
+	private:
+		size_t _limit;
+	};
+
+	/// Settings of a single parse.
+	struct ParseOptions {
+		/// Number of continuations that may be nested on the native stack. Deeper ones are resumed from the
+		/// Trampoline's work list, which bounds the stack a parse needs regardless of the nesting of the input.
+		size_t max_depth = 128;
+		Schedule schedule = Schedule::LIFO;
+		/// Threads Trampoline::run() uses. With more than one, each has a deque of descriptors and steals from the
+		/// others once it runs dry, so the alternatives of rules are parsed in parallel and schedule is ignored.
+		/// Recording parses (see IncrementalParse) always run on one thread.
+		size_t threads = 1;
+		/// Stop the parse with ParseStopped once it ran this many descriptors, once timeout passed since it started or
+		/// once cancellation is cancelled. Checked before each descriptor, the clock and the token only every
+		/// Trampoline::STOP_CHECK_INTERVAL descriptors.
+		size_t max_steps = SIZE_MAX;
+		std::chrono::steady_clock::duration timeout = std::chrono::steady_clock::duration::max();
+		std::optional<CancellationToken> cancellation;
+		/// Stop the parse with BudgetExceeded once more GSS nodes are alive at once, more results were popped from
+		/// them in total, or the parse holds more bytes than this. Bytes are estimated from the sizes of the GSS nodes
+		/// and the continuations, results and positions they keep, the queued descriptors and the closures they run,
+		/// cached scans and failures. Going over max_steps throws BudgetExceeded too.
+		size_t max_gss_nodes = SIZE_MAX;
+		size_t max_results = SIZE_MAX;
+		size_t max_memory = SIZE_MAX;
+		/// Once the parse ran this many descriptors, settle for the first parse: the first success that reaches the
+		/// end of the input ends it, the work still pending is dropped and no further results are collected. Tell by
+		/// Trampoline::degraded() (or ParseContext::degraded()) whether that happened.
+		size_t degrade_after = SIZE_MAX;
+		/// Keep at most this many GSS nodes active per input position (at least one), i.e. created, returning or
+		/// entering their rule body in tail position there. That bounds the work of a parse to O(beam_width * n)
+		/// regardless of the ambiguity. Nodes rank by the weight of their rule (see Parser::set_weight()), then by
+		/// age, callers ahead of the rules they call. A node ranking behind all of a full position isn't active there,
+		/// otherwise the last ranking one is pruned: it passes on no further results and its pending work is dropped.
+		/// Ties are broken the same way on every run, as long as one thread runs the parse. Not applied while
+		/// recording (see IncrementalParse).
+		size_t beam_width = SIZE_MAX;
+		/// By default a parse returns every success, or if there is none every failure, the results that stop before
+		/// the end of the input as "Tail left". With this it only returns what it found at the furthest position it
+		/// reached: "Tail left" if that's before the end, otherwise the successes, otherwise the distinct errors. A
+		/// parse can run into a failure at every position, this keeps what it collects from growing with the input.
+		bool furthest_results = false;
+		/// Run the parse on the coroutine backend: rules and the Sequences and Repetitions that call them are C++20
+		/// coroutines instead of continuations, see CoroutineScheduler. The results are the same. Throws
+		/// std::logic_error where Gllpp is built without coroutines and std::invalid_argument with more than one
+		/// thread. beam_width doesn't apply, and IncrementalParse ignores it.
+		bool coroutines = false;
+	};
+
+
+
+
+	/// Pending work of a parse: run a slot at an input position, on behalf of a GSS node. What a slot does and the
+	/// state it needs is kept by the Trampoline, so descriptors are plain values.
+	struct Descriptor {
+		static constexpr uint32_t NO_NODE = UINT32_MAX;
+
+		uint32_t slot;
+		uint32_t node;
+		uint64_t position;
+	};
+
+	static_assert(sizeof(Descriptor) == 16);
+
+	/// Descriptors in a ring buffer that is taken from according to a Schedule. For Schedule::POSITION the
+	/// buffer is kept as a binary min-heap on the position. For Schedule::BEST_FIRST the descriptors go to a bucket
+	/// per position instead, a list ordered by weight, and a bitmap of the buckets in use finds the furthest one. The
+	/// buckets are a ring as well, so they only span the positions queued at the same time.
+	class DescriptorQueue {
+	public:
+		DescriptorQueue(Schedule schedule)
+			: _schedule(schedule) {
+		}
+
+		Schedule schedule() const {
+			return _schedule;
+		}
+
+		bool empty() const {
+			return _size == 0;
+		}
+
+		size_t size() const {
+			return _size;
+		}
+
+		/// weight only matters to Schedule::BEST_FIRST.
+		void push(Descriptor descriptor, int weight = 0) {
+			if (_schedule == Schedule::BEST_FIRST) {
+				_push_bucket(descriptor, weight);
+				return;
+			}
+
+			if (_size == _ring.size()) {
+				_grow();
+			}
+
+			_at(_size++) = descriptor;
+			if (_schedule == Schedule::POSITION) {
+				_sift_up(_size - 1);
+			}
+		}
+
+		void clear() {
+			_head = 0;
+			_size = 0;
+			if (!_entries.empty()) {
+				std::fill(_buckets.begin(), _buckets.end(), NO_ENTRY);
+				std::fill(_used.begin(), _used.end(), 0);
+				_entries.clear();
+				_freeEntries = NO_ENTRY;
+			}
+		}
+
+		Descriptor take() {
+			switch (_schedule) {
+			case Schedule::BEST_FIRST:
+				return _take_bucket();
+			case Schedule::FIFO: {
+				const auto descriptor = _at(0);
+				_head = (_head + 1) & (_ring.size() - 1);
+				--_size;
+				return descriptor;
+			}
+			case Schedule::POSITION: {
+				const auto descriptor = _at(0);
+				_at(0) = _at(--_size);
+				_sift_down(0);
+				return descriptor;
+			}
+			default:
+				return _at(--_size);
+			}
+		}
+
+	private:
+		Descriptor& _at(size_t index) {
+			return _ring[(_head + index) & (_ring.size() - 1)];
+		}
+
+		/// Double the capacity, which stays a power of two. Unwraps the ring.
+		void _grow() {
+			std::vector<Descriptor> ring(std::max<size_t>(_ring.size() * 2, 64));
+			for (size_t i = 0; i < _size; ++i) {
+				ring[i] = _at(i);
+			}
+
+			_ring = std::move(ring);
+			_head = 0;
+		}
+
+		void _sift_up(size_t index) {
+			while (index > 0) {
+				const auto parent = (index - 1) / 2;
+				if (_at(parent).position <= _at(index).position)
+					return;
+
+				std::swap(_at(parent), _at(index));
+				index = parent;
+			}
+		}
+
+		void _sift_down(size_t index) {
+			for (;;) {
+				auto smallest = index;
+				for (auto child = 2 * index + 1; child <= 2 * index + 2 && child < _size; ++child) {
+					if (_at(child).position < _at(smallest).position) {
+						smallest = child;
+					}
+				}
+
+				if (smallest == index)
+					return;
+
+				std::swap(_at(smallest), _at(index));
+				index = smallest;
+			}
+		}
+
+		void _push_bucket(Descriptor descriptor, int weight) {
+			const auto position = descriptor.position;
+			if (_size == 0) {
+				// All buckets are empty, they may as well start here.
+				_low = position;
+				_top = position;
+			}
+			else if (std::max(_top, position) - std::min(_low, position) >= _buckets.size()) {
+				// The buckets before the furthest one are taken last, but the lowest ones may be gone.
+				_low = _nearest_from(_low);
+			}
+
+			const auto low = std::min(_low, position);
+			if (std::max(_top, position) - low >= _buckets.size()) {
+				_grow_buckets(std::max(_top, position) - low + 1);
+			}
+			_low = low;
+
+			const size_t bucket = position & (_buckets.size() - 1);
+
+			uint32_t entry;
+			if (_freeEntries != NO_ENTRY) {
+				entry = _freeEntries;
+				_freeEntries = _entries[entry].next;
+			}
+			else {
+				entry = static_cast<uint32_t>(_entries.size());
+				_entries.emplace_back();
+			}
+
+			// Behind the entries of higher weight, before the ones of the same or lower weight.
+			auto* link = &_buckets[bucket];
+			while (*link != NO_ENTRY && _entries[*link].weight > weight) {
+				link = &_entries[*link].next;
+			}
+			_entries[entry] = { descriptor, weight, *link };
+			*link = entry;
+
+			_used[bucket / 64] |= uint64_t{ 1 } << (bucket % 64);
+			_top = std::max(_top, position);
+			++_size;
+		}
+
+		Descriptor _take_bucket() {
+			const size_t bucket = _top & (_buckets.size() - 1);
+			auto& head = _buckets[bucket];
+			const auto entry = head;
+			head = _entries[entry].next;
+			_entries[entry].next = _freeEntries;
+			_freeEntries = entry;
+
+			--_size;
+			if (head == NO_ENTRY) {
+				_used[bucket / 64] &= ~(uint64_t{ 1 } << (bucket % 64));
+				if (_size > 0) {
+					_top = _furthest_below(_top);
+				}
+			}
+			return _entries[entry].descriptor;
+		}
+
+		/// Furthest position in use before position, there has to be one.
+		uint64_t _furthest_below(uint64_t position) const {
+			const size_t mask = _buckets.size() - 1;
+			const size_t bucket = position & mask;
+			auto word = bucket / 64;
+			auto bits = _used[word] & ((uint64_t{ 1 } << (bucket % 64)) - 1);
+			while (bits == 0) {
+				word = (word + _used.size() - 1) & (_used.size() - 1);
+				bits = _used[word];
+			}
+
+			size_t highest = 0;
+			for (size_t shift = 32; shift > 0; shift /= 2) {
+				if (bits >> shift) {
+					bits >>= shift;
+					highest += shift;
+				}
+			}
+			return position - ((bucket - (word * 64 + highest)) & mask);
+		}
+
+		/// Nearest position in use from position on, there has to be one.
+		uint64_t _nearest_from(uint64_t position) const {
+			const size_t mask = _buckets.size() - 1;
+			const size_t bucket = position & mask;
+			auto word = bucket / 64;
+			auto bits = _used[word] & (~uint64_t{ 0 } << (bucket % 64));
+			while (bits == 0) {
+				word = (word + 1) & (_used.size() - 1);
+				bits = _used[word];
+			}
+
+			size_t lowest = 0;
+			for (size_t shift = 32; shift > 0; shift /= 2) {
+				if ((bits & ((uint64_t{ 1 } << shift) - 1)) == 0) {
+					bits >>= shift;
+					lowest += shift;
+				}
+			}
+			return position + ((word * 64 + lowest - bucket) & mask);
+		}
+
+		/// At least double the buckets, to a power of two of at least span. The buckets of the positions from _low
+		/// to _top move to their place in the bigger ring, only the bitmap words of those in use are touched.
+		void _grow_buckets(uint64_t span) {
+			auto size = std::max<size_t>(_buckets.size() * 2, 64);
+			while (size < span) {
+				size *= 2;
+			}
+
+			std::vector<uint32_t> buckets(size, NO_ENTRY);
+			std::vector<uint64_t> used(size / 64);
+			if (_size > 0) {
+				const size_t mask = _buckets.size() - 1;
+				for (auto position = _low; position <= _top; ++position) {
+					const size_t from = position & mask;
+					if (_buckets[from] == NO_ENTRY)
+						continue;
+
+					const size_t to = position & (size - 1);
+					buckets[to] = _buckets[from];
+					used[to / 64] |= uint64_t{ 1 } << (to % 64);
+				}
+			}
+
+			_buckets = std::move(buckets);
+			_used = std::move(used);
+		}
+
+		static constexpr uint32_t NO_ENTRY = UINT32_MAX;
+
+		struct Entry {
+			Descriptor descriptor;
+			int weight;
+			uint32_t next;
+		};
+
+		Schedule _schedule;
+		std::vector<Descriptor> _ring;
+		size_t _head = 0;
+		size_t _size = 0;
+		/// Schedule::BEST_FIRST: first entry of the bucket of each position, at the position modulo the power of two
+		/// size of the ring, whether each one is in use, and the entries, the unused ones linked from _freeEntries.
+		/// The queued positions are between _low and the furthest one, _top.
+		std::vector<uint32_t> _buckets;
+		std::vector<uint64_t> _used;
+		std::vector<Entry> _entries;
+		uint32_t _freeEntries = NO_ENTRY;
+		uint64_t _low = 0;
+		uint64_t _top = 0;
+	};
+
+	/// Indices 0 to count split into one range per worker. Workers take from the front of their own range. Once it's
+	/// empty they steal the back half of the largest other one, so workers that got the cheap items help the others.
+	class StealingRanges {
+	public:
+		StealingRanges(size_t count, size_t workers)
+			: _ranges(workers) {
+			for (size_t i = 0; i < workers; ++i) {
+				_ranges[i].begin = count * i / workers;
+				_ranges[i].end = count * (i + 1) / workers;
+			}
+		}
+
+		/// Next index for worker, nothing once all ranges are empty.
+		std::optional<size_t> take(size_t worker) {
+			auto& own = _ranges[worker];
+			{
+				std::lock_guard<std::mutex> lock{ own.mutex };
+				if (own.begin < own.end)
+					return own.begin++;
+			}
+
+			for (;;) {
+				// Sizes read without the lock are only a hint which range to try.
+				Range* victim = nullptr;
+				size_t largest = 0;
+				for (auto& range : _ranges) {
+					const auto begin = range.begin.load(std::memory_order_relaxed);
+					const auto end = range.end.load(std::memory_order_relaxed);
+					if (&range != &own && end > begin && end - begin > largest) {
+						victim = &range;
+						largest = end - begin;
+					}
+				}
+
+				if (victim == nullptr)
+					return std::nullopt;
+
+				size_t begin, end;
+				{
+					std::lock_guard<std::mutex> lock{ victim->mutex };
+					if (victim->begin >= victim->end)
+						continue;
+
+					begin = victim->begin + (victim->end - victim->begin) / 2;
+					end = victim->end;
+					victim->end = begin;
+				}
+
+				std::lock_guard<std::mutex> lock{ own.mutex };
+				own.begin = begin + 1;
+				own.end = end;
+				return begin;
+			}
+		}
+
+	private:
+		/// Own cache line each, workers mostly touch their own.
+		struct alignas(64) Range {
+			std::mutex mutex;
+			std::atomic<size_t> begin{ 0 };
+			std::atomic<size_t> end{ 0 };
+		};
+
+		std::vector<Range> _ranges;
+	};
+
+	/// Chase-Lev work-stealing deque. The owning thread pushes and pops at the bottom, other threads steal from the
+	/// top. Descriptors are kept as two atomic words, so a steal that reads a slot the owner is overwriting fails
+	/// its compare-exchange instead of racing.
+	class StealingDeque {
+	public:
+		StealingDeque() {
+			_grow(nullptr, 0, 0);
+		}
+
+		StealingDeque(const StealingDeque&) = delete;
+		StealingDeque& operator=(const StealingDeque&) = delete;
+
+		/// Owner only.
+		void push(Descriptor descriptor) {
+			const auto bottom = _bottom.load(std::memory_order_relaxed);
+			const auto top = _top.load(std::memory_order_acquire);
+			auto buffer = _buffer.load(std::memory_order_relaxed);
+			if (bottom - top >= static_cast<int64_t>(buffer->mask)) {
+				buffer = _grow(buffer, top, bottom);
+			}
+
+			buffer->put(bottom, descriptor);
+			_bottom.store(bottom + 1, std::memory_order_release);
+		}
+
+		/// Owner only, most recent first.
+		std::optional<Descriptor> pop() {
+			const auto bottom = _bottom.load(std::memory_order_relaxed) - 1;
+			const auto buffer = _buffer.load(std::memory_order_relaxed);
+			_bottom.store(bottom, std::memory_order_seq_cst);
+
+			auto top = _top.load(std::memory_order_seq_cst);
+			if (top > bottom) {
+				_bottom.store(bottom + 1, std::memory_order_relaxed);
+				return std::nullopt;
+			}
+
+			std::optional<Descriptor> descriptor = buffer->get(bottom);
+			if (top == bottom) {
+				// Last one, thieves may be after it too.
+				if (!_top.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+					descriptor.reset();
+				}
+				_bottom.store(bottom + 1, std::memory_order_relaxed);
+			}
+			return descriptor;
+		}
+
+		/// Any thread, oldest first. Nothing if the deque is empty or another thread took the descriptor first.
+		std::optional<Descriptor> steal() {
+			auto top = _top.load(std::memory_order_seq_cst);
+			const auto bottom = _bottom.load(std::memory_order_seq_cst);
+			if (top >= bottom)
+				return std::nullopt;
+
+			const auto descriptor = _buffer.load(std::memory_order_acquire)->get(top);
+			if (!_top.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+				return std::nullopt;
+
+			return descriptor;
+		}
+
+		/// Owner only, while no thread steals.
+		void clear() {
+			_top = 0;
+			_bottom = 0;
+			reclaim();
+		}
+
+		/// Owner only, while no thread steals. Frees the buffers the deque grew out of, which thieves may have still
+		/// been reading until now.
+		void reclaim() {
+			if (_buffers.size() > 1) {
+				_buffers.erase(_buffers.begin(), _buffers.end() - 1);
+			}
+		}
+
+	private:
+		struct Buffer {
+			Buffer(size_t capacity)
+				: mask(capacity - 1)
+				, words(new std::atomic<uint64_t>[capacity * 2]) {
+			}
+
+			void put(int64_t index, Descriptor descriptor) {
+				const auto at = (static_cast<size_t>(index) & mask) * 2;
+				words[at].store(static_cast<uint64_t>(descriptor.slot) << 32 | descriptor.node, std::memory_order_relaxed);
+				words[at + 1].store(descriptor.position, std::memory_order_relaxed);
+			}
+
+			Descriptor get(int64_t index) const {
+				const auto at = (static_cast<size_t>(index) & mask) * 2;
+				const auto ids = words[at].load(std::memory_order_relaxed);
+				return { static_cast<uint32_t>(ids >> 32), static_cast<uint32_t>(ids), words[at + 1].load(std::memory_order_relaxed) };
+			}
+
+			size_t mask;
+			std::unique_ptr<std::atomic<uint64_t>[]> words;
+		};
+
+		/// Copy the descriptors from top to bottom into a buffer of twice the size. Thieves may still read the old
+		/// one, so it's kept until reclaim(). Together the old ones are smaller than the new one.
+		Buffer* _grow(Buffer* buffer, int64_t top, int64_t bottom) {
+			_buffers.push_back(std::make_unique<Buffer>(buffer != nullptr ? (buffer->mask + 1) * 2 : 64));
+			const auto grown = _buffers.back().get();
+			for (auto i = top; i < bottom; ++i) {
+				grown->put(i, buffer->get(i));
+			}
+
+			_buffer.store(grown, std::memory_order_release);
+			return grown;
+		}
+
+		alignas(64) std::atomic<int64_t> _top{ 0 };
+		alignas(64) std::atomic<int64_t> _bottom{ 0 };
+		std::atomic<Buffer*> _buffer{ nullptr };
+		std::vector<std::unique_ptr<Buffer>> _buffers;
+	};
+
+	/// Set of keys below MAX_KEY that threads insert into without locks, e.g. packed (GSS node, position) pairs. Open
+	/// addressing with linear probing. Once a table is half full, one twice the size follows it. Every thread that
+	/// notices helps moving the keys over, chunk by chunk and slot by slot, so no thread waits for another one.
+	class ConcurrentKeySet {
+	public:
+		static constexpr uint64_t MAX_KEY = (uint64_t{ 1 } << 63) - 1;
+
+		/// capacity has to be a power of two.
+		ConcurrentKeySet(size_t capacity = 1024)
+			: _first(new Table(capacity))
+			, _current(_first.get()) {
+		}
+
+		ConcurrentKeySet(const ConcurrentKeySet&) = delete;
+		ConcurrentKeySet& operator=(const ConcurrentKeySet&) = delete;
+
+		/// Whether key wasn't in the set yet. Exactly one of the threads inserting the same key gets true.
+		bool insert(uint64_t key) {
+			return _insert(_current.load(std::memory_order_acquire), key + 1);
+		}
+
+		/// Remove all keys, keeping the largest table. No thread may insert meanwhile.
+		void clear() {
+			const auto last = _current.load(std::memory_order_relaxed);
+			if (last != _first.get()) {
+				auto before = _first.get();
+				while (before->next.load(std::memory_order_relaxed) != last) {
+					before = before->next.load(std::memory_order_relaxed);
+				}
+				before->next.store(nullptr, std::memory_order_relaxed);
+				_first.reset(last);
+			}
+
+			last->reset();
+		}
+
+		/// Number of slots of the current table.
+		size_t capacity() const {
+			return _current.load(std::memory_order_relaxed)->mask + 1;
+		}
+
+	private:
+		/// Slot values: the key plus one, EMPTY, or either with MOVED set once it's in the next table.
+		static constexpr uint64_t EMPTY = 0;
+		static constexpr uint64_t MOVED = uint64_t{ 1 } << 63;
+		/// Slots moved at a time by one thread.
+		static constexpr size_t CHUNK = 1024;
+
+		enum class Probe {
+			INSERTED,
+			PRESENT,
+			/// The table is being moved to the next one.
+			MOVING
+		};
+
+		struct Table {
+			Table(size_t capacity)
+				: mask(capacity - 1)
+				, slots(new std::atomic<uint64_t>[capacity]())
+				, chunks((capacity + CHUNK - 1) / CHUNK)
+				, moved(new std::atomic<bool>[chunks]()) {
+			}
+
+			~Table() {
+				delete next.load(std::memory_order_relaxed);
+			}
+
+			Probe probe(uint64_t value) {
+				// Finalizer of splitmix64, keys are often dense.
+				auto hash = value;
+				hash = (hash ^ (hash >> 30)) * 0xBF58476D1CE4E5B9ull;
+				hash = (hash ^ (hash >> 27)) * 0x94D049BB133111EBull;
+				hash ^= hash >> 31;
+
+				for (size_t i = 0, at = static_cast<size_t>(hash) & mask; i <= mask; ++i, at = (at + 1) & mask) {
+					auto current = slots[at].load(std::memory_order_acquire);
+					for (;;) {
+						if (current == EMPTY) {
+							if (slots[at].compare_exchange_weak(current, value, std::memory_order_acq_rel, std::memory_order_acquire))
+								return Probe::INSERTED;
+
+							continue;
+						}
+
+						// Moved keys are in the next table, or about to be.
+						if ((current & ~MOVED) == value)
+							return Probe::PRESENT;
+
+						if (current & MOVED)
+							return Probe::MOVING;
+
+						break;
+					}
+				}
+				return Probe::MOVING;
+			}
+
+			void reset() {
+				for (size_t i = 0; i <= mask; ++i) {
+					slots[i].store(EMPTY, std::memory_order_relaxed);
+				}
+				for (size_t i = 0; i < chunks; ++i) {
+					moved[i].store(false, std::memory_order_relaxed);
+				}
+				count = 0;
+				claimed = 0;
+			}
+
+			size_t mask;
+			std::unique_ptr<std::atomic<uint64_t>[]> slots;
+			size_t chunks;
+			std::unique_ptr<std::atomic<bool>[]> moved;
+			std::atomic<size_t> count{ 0 };
+			/// Chunks handed out for moving.
+			std::atomic<size_t> claimed{ 0 };
+			/// Owned.
+			std::atomic<Table*> next{ nullptr };
+		};
+
+		bool _insert(Table* table, uint64_t value) {
+			for (;;) {
+				if (table->next.load(std::memory_order_acquire) != nullptr) {
+					table = _move(table);
+					continue;
+				}
+
+				switch (table->probe(value)) {
+				case Probe::INSERTED:
+					if (table->count.fetch_add(1, std::memory_order_relaxed) + 1 > (table->mask + 1) / 2) {
+						_grow(table);
+					}
+					return true;
+				case Probe::PRESENT:
+					return false;
+				default:
+					_grow(table);
+					table = _move(table);
+				}
+			}
+		}
+
+		void _grow(Table* table) {
+			if (table->next.load(std::memory_order_acquire) != nullptr)
+				return;
+
+			auto next = std::make_unique<Table>((table->mask + 1) * 2);
+			Table* expected = nullptr;
+			if (table->next.compare_exchange_strong(expected, next.get(), std::memory_order_acq_rel)) {
+				next.release();
+			}
+		}
+
+		/// Move all keys of table to the next one, together with the other threads that do. Claims chunks while there
+		/// are any, then moves what's left of the chunks other threads are still at. Returns the next table, which
+		/// becomes the current one.
+		Table* _move(Table* table) {
+			const auto next = table->next.load(std::memory_order_acquire);
+			for (;;) {
+				const auto chunk = table->claimed.fetch_add(1, std::memory_order_relaxed);
+				if (chunk >= table->chunks)
+					break;
+
+				_move_chunk(table, next, chunk);
+			}
+
+			for (size_t chunk = 0; chunk < table->chunks; ++chunk) {
+				if (!table->moved[chunk].load(std::memory_order_acquire)) {
+					_move_chunk(table, next, chunk);
+				}
+			}
+
+			auto expected = table;
+			_current.compare_exchange_strong(expected, next, std::memory_order_acq_rel);
+			return next;
+		}
+
+		/// Moving a slot is idempotent, several threads may move the same one.
+		void _move_chunk(Table* table, Table* next, size_t chunk) {
+			const auto end = std::min((chunk + 1) * CHUNK, table->mask + 1);
+			for (auto at = chunk * CHUNK; at < end; ++at) {
+				auto current = table->slots[at].load(std::memory_order_acquire);
+				while (!(current & MOVED)) {
+					if (current != EMPTY) {
+						_insert(next, current);
+					}
+					// Only fails if another thread inserted into the empty slot or moved it.
+					table->slots[at].compare_exchange_weak(current, current | MOVED, std::memory_order_acq_rel, std::memory_order_acquire);
+				}
+			}
+			table->moved[chunk].store(true, std::memory_order_release);
+		}
+
+		std::unique_ptr<Table> _first;
+		std::atomic<Table*> _current;
+	};
+
+	/// Fixed-size queue of indices that any number of threads push to and pop from without locks. Each cell carries a
+	/// sequence number telling whether it's free for the push or filled for the pop of the current lap around the ring.
+	class BoundedQueue {
+	public:
+		/// Holds at least capacity values.
+		explicit BoundedQueue(size_t capacity) {
+			size_t size = 2;
+			while (size < capacity) {
+				size *= 2;
+			}
+
+			_cells.reset(new Cell[size]);
+			_mask = size - 1;
+			for (size_t i = 0; i < size; ++i) {
+				_cells[i].sequence.store(i, std::memory_order_relaxed);
+			}
+		}
+
+		/// False if the queue is full.
+		bool push(size_t value) {
+			auto tail = _tail.load(std::memory_order_relaxed);
+			for (;;) {
+				auto& cell = _cells[tail & _mask];
+				const auto sequence = cell.sequence.load(std::memory_order_acquire);
+				if (sequence == tail) {
+					if (_tail.compare_exchange_weak(tail, tail + 1, std::memory_order_relaxed)) {
+						cell.value = value;
+						cell.sequence.store(tail + 1, std::memory_order_release);
+						return true;
+					}
+				}
+				else if (sequence < tail)
+					return false;
+				else {
+					tail = _tail.load(std::memory_order_relaxed);
+				}
+			}
+		}
+
+		/// Nothing if the queue is empty.
+		std::optional<size_t> pop() {
+			auto head = _head.load(std::memory_order_relaxed);
+			for (;;) {
+				auto& cell = _cells[head & _mask];
+				const auto sequence = cell.sequence.load(std::memory_order_acquire);
+				if (sequence == head + 1) {
+					if (_head.compare_exchange_weak(head, head + 1, std::memory_order_relaxed)) {
+						const auto value = cell.value;
+						cell.sequence.store(head + _mask + 1, std::memory_order_release);
+						return value;
+					}
+				}
+				else if (sequence < head + 1)
+					return std::nullopt;
+				else {
+					head = _head.load(std::memory_order_relaxed);
+				}
+			}
+		}
+
+	private:
+		struct alignas(64) Cell {
+			std::atomic<size_t> sequence;
+			size_t value;
+		};
+
+		std::unique_ptr<Cell[]> _cells;
+		size_t _mask;
+		alignas(64) std::atomic<size_t> _tail{ 0 };
+		alignas(64) std::atomic<size_t> _head{ 0 };
+	};
+
+	/// Fixed number of threads that run the jobs posted to them in order, see ComposableParser::parse_async(). Jobs
+	/// still queued when the pool is destroyed are dropped, the ones running are waited for.
+	class WorkerPool {
+	public:
+		/// threads 0 for one per core.
+		explicit WorkerPool(size_t threads = 0) {
+			if (threads == 0) {
+				threads = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+			}
+
+			try {
+				for (size_t i = 0; i < threads; ++i) {
+					_threads.emplace_back([this]() {
+						_work();
+					});
+				}
+			}
+			catch (...) {
+				_stop();
+				throw;
+			}
+		}
+
+		WorkerPool(const WorkerPool&) = delete;
+		WorkerPool& operator=(const WorkerPool&) = delete;
+
+		~WorkerPool() {
+			_stop();
+		}
+
+		/// Pool shared by the whole process, one thread per core.
+		static WorkerPool& shared() {
+			static WorkerPool pool;
+			return pool;
+		}
+
+		size_t threads() const {
+			return _threads.size();
+		}
+
+		void post(std::function<void()> job) {
+			{
+				std::lock_guard<std::mutex> lock{ _mutex };
+				_jobs.push_back(std::move(job));
+			}
+			_wake.notify_one();
+		}
+
+	private:
+		void _work() {
+			for (;;) {
+				std::function<void()> job;
+				{
+					std::unique_lock<std::mutex> lock{ _mutex };
+					_wake.wait(lock, [this]() {
+						return _stopping || !_jobs.empty();
+					});
+					if (_stopping)
+						return;
+
+					job = std::move(_jobs.front());
+					_jobs.pop_front();
+				}
+				job();
+			}
+		}
+
+		void _stop() {
+			{
+				std::lock_guard<std::mutex> lock{ _mutex };
+				_stopping = true;
+			}
+			_wake.notify_all();
+			for (auto& thread : _threads) {
+				thread.join();
+			}
+			_jobs.clear();
+		}
+
+		std::mutex _mutex;
+		std::condition_variable _wake;
+		std::deque<std::function<void()>> _jobs;
+		bool _stopping = false;
+		std::vector<std::thread> _threads;
+	};
+
+	/// Hash map that keeps its table when cleared. Entries are stamped with the generation they were inserted in, and
+	/// clear() starts a new generation, so entries of earlier ones count as empty without touching them. Open addressing
+	/// with linear probing. Key and Value have to be cheap to copy.
+	template<typename Key, typename Value, typename Hash>
+	class GenerationMap {
+	public:
+		Value* find(const Key& key) {
+			if (_entries.empty())
+				return nullptr;
+
+			for (auto at = _home(key);; at = (at + 1) & _mask) {
+				auto& entry = _entries[at];
+				if (entry.generation != _generation)
+					return nullptr;
+				if (entry.key == key)
+					return &entry.value;
+			}
+		}
+
+		/// Value of key, value if it wasn't in the map yet. The second is whether it was inserted.
+		std::pair<Value*, bool> emplace(const Key& key, const Value& value) {
+			if ((_used.size() + 1) * 2 > _entries.size()) {
+				_grow();
+			}
+
+			for (auto at = _home(key);; at = (at + 1) & _mask) {
+				auto& entry = _entries[at];
+				if (entry.generation != _generation) {
+					entry = { _generation, key, value };
+					_used.push_back(static_cast<uint32_t>(at));
+					return { &entry.value, true };
+				}
+				if (entry.key == key)
+					return { &entry.value, false };
+			}
+		}
+
+		Value& operator[](const Key& key) {
+			return *emplace(key, Value{}).first;
+		}
+
+		size_t size() const {
+			return _used.size();
+		}
+
+		/// Takes time proportional to the entries inserted since the last clear(), not the size of the table.
+		void clear() {
+			++_generation;
+			_used.clear();
+		}
+
+		/// Remove the entries pred(key, value) is true for.
+		template<typename F>
+		void erase_if(F pred) {
+			_kept.clear();
+			for (auto at : _used) {
+				auto& entry = _entries[at];
+				if (!pred(entry.key, entry.value)) {
+					_kept.push_back(entry);
+				}
+			}
+
+			// Probe sequences can't have holes, so the rest is inserted again.
+			clear();
+			for (auto& entry : _kept) {
+				emplace(entry.key, entry.value);
+			}
+		}
+
+	private:
+		struct Entry {
+			size_t generation = 0;
+			Key key{};
+			Value value{};
+		};
+
+		size_t _home(const Key& key) const {
+			// Mix, the hashes of the keys are plain combinations of pointers and positions.
+			auto hash = static_cast<uint64_t>(Hash{}(key));
+			hash ^= hash >> 33;
+			hash *= 0xFF51AFD7ED558CCDull;
+			hash ^= hash >> 33;
+			return static_cast<size_t>(hash) & _mask;
+		}
+
+		void _grow() {
+			_kept.clear();
+			for (auto at : _used) {
+				_kept.push_back(_entries[at]);
+			}
+
+			_entries.assign(std::max<size_t>(_entries.size() * 2, 16), Entry{});
+			_mask = _entries.size() - 1;
+			_generation = 1;
+			_used.clear();
+			for (auto& entry : _kept) {
+				emplace(entry.key, entry.value);
+			}
+		}
+
+		std::vector<Entry> _entries;
+		size_t _mask = 0;
+		size_t _generation = 1;
+		/// Indices of the entries of the current generation.
+		std::vector<uint32_t> _used;
+		std::vector<Entry> _kept;
+	};
+
+
+
+
+	/// Callable like std::function<void(Trampoline&, ParserResult)>, for the continuations a parse creates, copies and
+	/// drops all the time. Closures of up to INLINE_SIZE bytes, which most continuations are, are kept in place
+	/// instead of on the heap.
+	class Continuation {
+	public:
+		static constexpr size_t INLINE_SIZE = 64;
+
+		Continuation() = default;
+
+		Continuation(std::nullptr_t) {
+		}
+
+		template<typename F, typename = std::enable_if_t<!std::is_same_v<std::decay_t<F>, Continuation> && !std::is_same_v<std::decay_t<F>, std::nullptr_t>>>
+		Continuation(F&& f) {
+			using T = std::decay_t<F>;
+			if constexpr (_local<T>()) {
+				new (&_storage) T(std::forward<F>(f));
+			}
+			else {
+				_heap() = new T(std::forward<F>(f));
+			}
+			_ops = &OPS<T>;
+		}
+
+		Continuation(const Continuation& other) {
+			if (other._ops != nullptr) {
+				other._ops->copy(other, *this);
+				_ops = other._ops;
+			}
+		}
+
+		Continuation(Continuation&& other) noexcept {
+			_take(other);
+		}
+
+		Continuation& operator=(const Continuation& other) {
+			if (this != &other) {
+				Continuation copy{ other };
+				*this = std::move(copy);
+			}
+			return *this;
+		}
+
+		Continuation& operator=(Continuation&& other) noexcept {
+			if (this != &other) {
+				_reset();
+				_take(other);
+			}
+			return *this;
+		}
+
+		Continuation& operator=(std::nullptr_t) {
+			_reset();
+			return *this;
+		}
+
+		~Continuation() {
+			_reset();
+		}
+
+		/// Throws std::bad_function_call if there's no closure, like std::function.
+		void operator()(Trampoline& trampoline, ParserResult result) const {
+			if (_ops == nullptr)
+				throw std::bad_function_call();
+			_ops->invoke(*this, trampoline, std::move(result));
+		}
+
+		explicit operator bool() const {
+			return _ops != nullptr;
+		}
+
+		/// The closure if it's a T, nullptr otherwise.
+		template<typename T>
+		const T* target() const {
+			return _ops == &OPS<T> ? &_get<T>(*this) : nullptr;
+		}
+
+		/// Bytes the closure takes on the heap, 0 if it's kept inline.
+		size_t heap_size() const {
+			return _ops != nullptr ? _ops->heapSize : 0;
+		}
+
+	private:
+		struct Ops {
+			void (*invoke)(const Continuation& self, Trampoline& trampoline, ParserResult result);
+			void (*copy)(const Continuation& from, Continuation& to);
+			/// Leaves from without a closure.
+			void (*move)(Continuation& from, Continuation& to);
+			void (*destroy)(Continuation& self);
+			size_t heapSize;
+		};
+
+		template<typename T>
+		static constexpr bool _local() {
+			return sizeof(T) <= INLINE_SIZE && alignof(T) <= alignof(std::max_align_t) && std::is_nothrow_move_constructible_v<T>;
+		}
+
+		void*& _heap() const {
+			return *reinterpret_cast<void**>(const_cast<unsigned char*>(_storage));
+		}
+
+		template<typename T>
+		static T& _get(const Continuation& self) {
+			if constexpr (_local<T>()) {
+				return *reinterpret_cast<T*>(const_cast<unsigned char*>(self._storage));
+			}
+			else {
+				return *static_cast<T*>(self._heap());
+			}
+		}
+
+		template<typename T>
+		static void _invoke(const Continuation& self, Trampoline& trampoline, ParserResult result) {
+			_get<T>(self)(trampoline, std::move(result));
+		}
+
+		template<typename T>
+		static void _copy(const Continuation& from, Continuation& to) {
+			if constexpr (_local<T>()) {
+				new (&to._storage) T(_get<T>(from));
+			}
+			else {
+				to._heap() = new T(_get<T>(from));
+			}
+		}
+
+		template<typename T>
+		static void _move(Continuation& from, Continuation& to) {
+			if constexpr (_local<T>()) {
+				new (&to._storage) T(std::move(_get<T>(from)));
+				_get<T>(from).~T();
+			}
+			else {
+				to._heap() = from._heap();
+			}
+		}
+
+		template<typename T>
+		static void _destroy(Continuation& self) {
+			if constexpr (_local<T>()) {
+				_get<T>(self).~T();
+			}
+			else {
+				delete &_get<T>(self);
+			}
+		}
+
+		template<typename T>
+		static constexpr Ops OPS = { &_invoke<T>, &_copy<T>, &_move<T>, &_destroy<T>, _local<T>() ? 0 : sizeof(T) };
+
+		void _take(Continuation& other) {
+			if (other._ops != nullptr) {
+				other._ops->move(other, *this);
+				_ops = std::exchange(other._ops, nullptr);
+			}
+		}
+
+		void _reset() {
+			if (_ops != nullptr) {
+				std::exchange(_ops, nullptr)->destroy(*this);
+			}
+		}
+
+		alignas(std::max_align_t) unsigned char _storage[INLINE_SIZE];
+		const Ops* _ops = nullptr;
+	};
+
+	class Trampoline {
+	public:
+		using Continuation = Gllpp::Continuation;
+
+		/// Graph structured stack node: one invocation of a rule at a position, shared by all of its callers.
+		struct GssNode {
+			Trampoline* owner;
+			const void* rule;
+			std::string_view layout;
+			size_t position;
+			uint32_t index;
+			/// Weight of the rule, see Schedule::BEST_FIRST and ParseOptions::beam_width.
+			int weight;
+			/// Nodes created earlier have lower serials.
+			uint64_t serial;
+			/// Dropped from the beam, see ParseOptions::beam_width.
+			std::atomic<bool> pruned{ false };
+			/// Returns and descriptors referring to the node.
+			std::atomic<size_t> references{ 0 };
+			/// No more calls can join the node once the parse moved past its position.
+			bool evicted = false;
+			/// Guards the containers below while several threads run the parse.
+			std::mutex mutex;
+			/// Continuations keep their address while more are added, as they may be running.
+			std::list<Continuation> continuations;
+			/// Positions of the results.
+			std::vector<size_t> results;
+			/// Positions popped from the node, kept by the Trampoline instead if several threads run the parse.
+			std::unordered_set<size_t> popped;
+			/// Positions the rule body was entered at by calls of the rule in tail position of itself.
+			std::unordered_set<size_t> tails;
+			/// While recording: the node each continuation was added from, end of the input looked at and furthest
+			/// failures, the calls made included.
+			std::vector<GssNode*> callers;
+			size_t examined = 0;
+			size_t failurePosition = 0;
+			std::vector<std::string> failures;
+		};
+
+		/// Rule call of an earlier parse, which answers the same call of the next one as long as the input it looked
+		/// at is unchanged. See IncrementalParse.
+		struct Memo {
+			const void* rule;
+			std::string_view layout;
+			size_t position;
+			/// End of the input looked at, one past the end of the input if that was noticed.
+			size_t examined;
+			std::vector<size_t> results;
+			size_t failurePosition;
+			std::vector<std::string> failures;
+		};
+
+		/// Continuation of a rule body, hands its results to the rule's GSS node. Keeps the node alive.
+		struct Return {
+			Return(GssNode* node) noexcept
+				: node(node) {
+				++node->references;
+			}
+
+			Return(const Return& other) noexcept
+				: Return(other.node) {
+			}
+
+			Return& operator=(const Return& other) {
+				Return copy{ other };
+				std::swap(node, copy.node);
+				return *this;
+			}
+
+			~Return() {
+				node->owner->_release(*node);
+			}
+
+			void operator()(Trampoline& trampoline, ParserResult result) const {
+				trampoline.pop(*node, result);
+			}
+
+			GssNode* node;
+		};
+
+		/// Code run by descriptors, with the input at their position and their GSS node (nullptr if they have none).
+		using Slot = std::function<void(Trampoline&, std::string_view, GssNode*)>;
+
+		Trampoline(std::string_view str, const ParseOptions& options = {}, const TokenStream* tokens = nullptr)
+			: _str(str)
+			, _tokens(tokens)
+			, _maxDepth(options.max_depth)
+			, _queue(options.schedule)
+			, _gss(new GssStripe[options.threads > 1 ? GSS_STRIPES : 1])
+			, _stripes(options.threads > 1 ? GSS_STRIPES : 1)
+			, _maxSteps(options.max_steps)
+			, _timeout(options.timeout)
+			, _cancellation(options.cancellation)
+			, _maxGssNodes(options.max_gss_nodes)
+			, _maxResults(options.max_results)
+			, _maxMemory(options.max_memory)
+			, _degradeAfter(options.degrade_after)
+			, _beamWidth(std::max<size_t>(options.beam_width, 1))
+			, _furthestResults(options.furthest_results)
+			, _limited(options.max_steps != SIZE_MAX || options.timeout != std::chrono::steady_clock::duration::max() || options.cancellation
+				|| options.max_gss_nodes != SIZE_MAX || options.max_results != SIZE_MAX || options.max_memory != SIZE_MAX
+				|| options.degrade_after != SIZE_MAX) {
+			_start();
+			if (options.threads > 1) {
+				for (size_t i = 0; i < options.threads; ++i) {
+					_workers.emplace_back();
+				}
+				_popped.emplace();
+				_tails.emplace();
+			}
+		}
+
+		/// Input made of segments that follow each other in the document but not in memory, e.g. the pieces of a piece
+		/// table. Throws std::invalid_argument if segments overlap in memory.
+		Trampoline(const std::vector<std::string_view>& segments, const ParseOptions& options = {})
+			: Trampoline(std::string_view{}, options) {
+			size_t position = 0;
+			for (auto segment : segments) {
+				if (segment.empty())
+					continue;
+
+				_segments.push_back({ segment, position });
+				position += segment.size();
+			}
+
+			_byAddress.resize(_segments.size());
+			for (uint32_t i = 0; i < _segments.size(); ++i) {
+				_byAddress[i] = i;
+			}
+			std::sort(_byAddress.begin(), _byAddress.end(), [&](uint32_t lhs, uint32_t rhs) {
+				return std::less<const char*>{}(_segments[lhs].text.data(), _segments[rhs].text.data());
+			});
+
+			for (size_t i = 1; i < _byAddress.size(); ++i) {
+				const auto& previous = _segments[_byAddress[i - 1]].text;
+				if (std::less<const char*>{}(_segments[_byAddress[i]].text.data(), previous.data() + previous.size()))
+					throw std::invalid_argument("Gllpp: input segments overlap in memory");
+			}
+		}
+
+		Trampoline(const Trampoline&) = delete;
+		Trampoline& operator=(const Trampoline&) = delete;
+
+		~Trampoline() {
+			_drop_continuations();
+		}
+
+		/// Start over on str, as if newly constructed with the same options. The containers keep their capacity, so
+		/// parsing many small inputs with one Trampoline doesn't allocate them again each time.
+		void reset(std::string_view str, const TokenStream* tokens = nullptr) {
+			_drop_continuations();
+			for (auto& node : _nodes) {
+				if (node != nullptr) {
+					_spareNodes.push_back(std::move(node));
+				}
+			}
+			_nodes.clear();
+			_freeNodes.clear();
+			_dead.clear();
+			_freeSlots.clear();
+			_slotIds.clear();
+			_queue.clear();
+			for (auto& worker : _workers) {
+				worker.deque.clear();
+				worker.depth = 0;
+			}
+			_pending = 0;
+			if (_popped) {
+				_popped->clear();
+				_tails->clear();
+			}
+			_suspended.clear();
+			_suspendedMin = SIZE_MAX;
+			_lexed.clear();
+			for (size_t i = 0; i < _stripes; ++i) {
+				_gss[i].nodes.clear();
+			}
+			_beamIds.clear();
+			_beamsUsed = 0;
+			_freeBeams.clear();
+			_failed.clear();
+			_failurePosition = 0;
+			_frontier = 0;
+
+			_str = str;
+			_base = 0;
+			_segments.clear();
+			_byAddress.clear();
+			_segment = 0;
+			_complete = true;
+			_tokens = tokens;
+			_depth = 0;
+
+			_recording = false;
+			_reuse = nullptr;
+			_reused = 0;
+			_current = nullptr;
+			_watermark = 0;
+			_start();
+		}
+
+		/// Stream the input consists of, or nullptr when parsing bytes.
+		const TokenStream* tokens() const {
+			return _tokens;
+		}
+
+		/// Offset of a trail within the input.
+		size_t position(std::string_view trail) const {
+			if (_segments.empty())
+				return _base + static_cast<size_t>(trail.data() - _str.data());
+
+			// Trails only end up empty at the end of the input, see advance().
+			if (trail.empty())
+				return end();
+
+			const auto less = std::less<const char*>{};
+			auto index = _segment.load(std::memory_order_relaxed);
+			if (less(trail.data(), _segments[index].text.data()) || !less(trail.data(), _segments[index].text.data() + _segments[index].text.size())) {
+				const auto it = std::upper_bound(_byAddress.begin(), _byAddress.end(), trail.data(), [&](const char* data, uint32_t segment) {
+					return less(data, _segments[segment].text.data());
+				});
+				index = *(it - 1);
+				_segment.store(index, std::memory_order_relaxed);
+			}
+
+			const auto& segment = _segments[index];
+			return segment.position + static_cast<size_t>(trail.data() - segment.text.data());
+		}
+
+		/// Input from position on. With segmented input, only up to the end of the segment position is in.
+		std::string_view input(size_t position) const {
+			if (_segments.empty())
+				return _str.substr(position - _base);
+
+			if (position >= end())
+				return {};
+
+			auto index = _segment.load(std::memory_order_relaxed);
+			if (position < _segments[index].position || position >= _segments[index].position + _segments[index].text.size()) {
+				const auto it = std::upper_bound(_segments.begin(), _segments.end(), position, [](size_t position, const Segment& segment) {
+					return position < segment.position;
+				});
+				index = static_cast<size_t>(it - _segments.begin()) - 1;
+				_segment.store(index, std::memory_order_relaxed);
+			}
+
+			const auto& segment = _segments[index];
+			return segment.text.substr(position - segment.position);
+		}
+
+		/// str with n bytes consumed, which may lead into the following segments. Parsers create their trails with it,
+		/// so trails of segmented input never sit at the end of a segment but at the start of the next one.
+		std::string_view advance(std::string_view str, size_t n) const {
+			if (n < str.size() || _segments.empty())
+				return str.substr(n);
+
+			return input(position(str) + n);
+		}
+
+		/// Position of the end of the input received so far.
+		size_t end() const {
+			if (!_segments.empty())
+				return _segments.back().position + _segments.back().text.size();
+
+			return _base + _str.size();
+		}
+
+		/// Run dfa over the input from position on, across segments. f(length, kind) is called for every accepted
+		/// prefix. If the input is partial and runs out, where to continue from is returned (see Dfa::match()), with
+		/// the offset relative to position.
+		template<typename F>
+		std::optional<Dfa::Suspension> match(const Dfa& dfa, size_t position, F f, Dfa::Suspension from = {}) const {
+			for (;;) {
+				const auto view = input(position + from.offset);
+				const auto last = position + from.offset + view.size() == end();
+				size_t examined;
+				const auto suspension = dfa.match(view, [&](size_t length, int32_t kind) {
+					f(from.offset + length, kind);
+				}, !last || partial(), { from.state, 0 }, &examined);
+
+				if (!suspension) {
+					read(position + from.offset + examined);
+					return std::nullopt;
+				}
+
+				from = { suspension->state, from.offset + view.size() };
+				if (last) {
+					read(position + from.offset);
+					return from;
+				}
+			}
+		}
+
+		/// Longest prefix of the input from position on dfa accepts, see Dfa::longest().
+		std::pair<size_t, int32_t> longest(const Dfa& dfa, size_t position) const {
+			std::pair<size_t, int32_t> best{ 0, -1 };
+			const auto suspension = match(dfa, position, [&](size_t length, int32_t kind) {
+				best = { length, kind };
+			});
+			return suspension ? std::make_pair(size_t{ 0 }, Dfa::MORE) : best;
+		}
+
+		/// Whether more input may follow, i.e. parsers that run into the end of the input have to suspend().
+		bool partial() const {
+			return !_complete;
+		}
+
+		/// For streaming: str is the input from position base on, complete tells whether that's all of it. Input
+		/// before horizon() may be dropped. Suspended descriptors are queued again.
+		void feed(std::string_view str, size_t base, bool complete) {
+			_str = str;
+			_base = base;
+			_complete = complete;
+
+			for (auto& descriptor : _suspended) {
+				_push(descriptor);
+			}
+			_suspended.clear();
+			_suspendedMin = SIZE_MAX;
+		}
+
+		/// Run f(trampoline, str) once there's more input, with str grown accordingly.
+		template<typename F>
+		void suspend(std::string_view str, F f) {
+			const Descriptor descriptor{ _single_slot(f), Descriptor::NO_NODE, position(str) };
+			const auto lock = this->lock(_mutex);
+			_suspended.push_back(descriptor);
+			_suspendedMin = std::min<size_t>(_suspendedMin, _suspended.back().position);
+		}
+
+		/// Earliest position the parse still needs the input from.
+		size_t horizon() const {
+			return std::min({ _frontier, _suspendedMin, _failed.empty() ? SIZE_MAX : _failurePosition });
+		}
+
+		/// Track which input each rule call looks at, for memos(). Calls found in reuse (sorted by position) are
+		/// answered from there instead of running their bodies. Keeps all GSS nodes until the Trampoline is destroyed.
+		void record(const std::vector<Memo>* reuse = nullptr) {
+			_recording = true;
+			_reuse = reuse;
+			_workers.clear();
+			_popped.reset();
+			_tails.reset();
+		}
+
+		bool recording() const {
+			return _recording;
+		}
+
+		/// The running rule call looked at the input before end.
+		void read(size_t end) const {
+			if (!_recording)
+				return;
+
+			_watermark = std::max(_watermark, end);
+			if (_current != nullptr) {
+				_current->examined = std::max(_current->examined, end);
+			}
+		}
+
+		/// While recording, node of the rule call whose body runs from now on. Returns the one to go back to with leave().
+		GssNode* enter(GssNode* node) {
+			return _recording ? std::exchange(_current, node) : nullptr;
+		}
+
+		void leave(GssNode* node) {
+			if (_recording) {
+				_current = node;
+			}
+		}
+
+		/// Lock of mutex if several threads run the parse, one that isn't taken otherwise.
+		std::unique_lock<std::mutex> lock(std::mutex& mutex) const {
+			if (_workers.empty())
+				return std::unique_lock<std::mutex>{ mutex, std::defer_lock };
+
+			return std::unique_lock<std::mutex>{ mutex };
+		}
+
+		/// Number of rule calls that were answered from the memos passed to record().
+		size_t reused() const {
+			return _reused;
+		}
+
+		/// Rule calls of the finished parse that weren't answered from memos, sorted by position.
+		std::vector<Memo> memos() {
+			// Calls look at what the calls they make do. Calls can be cyclic, so propagate until nothing changes.
+			std::vector<GssNode*> work;
+			for (auto& node : _nodes) {
+				if (node != nullptr) {
+					work.push_back(node.get());
+				}
+			}
+
+			while (!work.empty()) {
+				const auto node = work.back();
+				work.pop_back();
+
+				for (auto caller : node->callers) {
+					if (caller == nullptr || caller == node)
+						continue;
+
+					auto changed = node->examined > caller->examined;
+					caller->examined = std::max(caller->examined, node->examined);
+					if (!node->failures.empty()) {
+						changed |= _merge_failures(*caller, node->failurePosition, node->failures);
+					}
+					if (changed) {
+						work.push_back(caller);
+					}
+				}
+			}
+
+			std::vector<Memo> memos;
+			for (auto& node : _nodes) {
+				if (node == nullptr)
+					continue;
+
+				auto results = node->results;
+				std::sort(results.begin(), results.end());
+				memos.push_back({ node->rule, node->layout, node->position, node->examined, std::move(results), node->failurePosition, node->failures });
+			}
+			std::sort(memos.begin(), memos.end(), [](const Memo& lhs, const Memo& rhs) {
+				return lhs.position < rhs.position;
+			});
+			return memos;
+		}
+
+		/// Result of scan() for the lexer, position and token set, shared by all branches of the parse. Results are
+		/// (consumed length, token kind). Scans that need more input aren't kept.
+		template<typename F>
+		std::pair<size_t, int32_t> lex(const void* lexer, size_t position, uint16_t set, F scan) {
+			const LexKey key{ lexer, position, set };
+			{
+				const auto lock = this->lock(_lexMutex);
+				if (const auto lexed = _lexed.find(key)) {
+					read(lexed->examined);
+					return lexed->result;
+				}
+			}
+
+			// Later calls that take the cached scan looked at the same input.
+			const auto watermark = _recording ? std::exchange(_watermark, 0) : 0;
+			const auto result = scan();
+			const auto examined = _recording ? std::exchange(_watermark, std::max(watermark, _watermark)) : 0;
+			if (result.second == Dfa::MORE)
+				return result;
+
+			// Another thread may have scanned the same meanwhile, its result is the same.
+			const auto lock = this->lock(_lexMutex);
+			const auto lexed = _lexed.emplace(key, Lexed{ result, examined });
+			if (lexed.second) {
+				_charge(LEXED_BYTES, position);
+			}
+			return lexed.first->result;
+		}
+
+		/// Call rule at str with continuation f. Returns the rule's GSS node if it was just created, in which case the
+		/// caller has to run the rule body with a Return to it. Otherwise f receives the results popped so far and
+		/// all further ones.
+		GssNode* call(const void* rule, std::string_view layout, std::string_view str, Continuation f, int weight = 0) {
+			const GssKey key{ rule, layout.data(), layout.size(), position(str) };
+			if (_recording) {
+				if (auto memo = _find_memo(rule, layout, key.position)) {
+					_answer(*memo, f);
+					return nullptr;
+				}
+			}
+
+			GssNode* joined;
+			{
+				auto& stripe = _stripe(key);
+				const auto stripeLock = lock(stripe.mutex);
+				const auto found = stripe.nodes.find(key);
+				if (found == nullptr) {
+					// Other threads only find the node once the stripe is unlocked.
+					const auto node = _beamWidth != SIZE_MAX && !_recording ? _new_beam_node(rule, layout, key.position, weight)
+						: _new_node(rule, layout, key.position, weight);
+					if (node == nullptr)
+						return nullptr;
+
+					stripe.nodes.emplace(key, node);
+					_add_continuation(*node, std::move(f));
+					if (_recording) {
+						node->callers.push_back(_current);
+						node->examined = key.position;
+					}
+					return node;
+				}
+				joined = *found;
+			}
+
+			if (joined->pruned.load(std::memory_order_relaxed))
+				return nullptr;
+
+			// Results popped from now on are passed to f by pop(), the ones before are passed here.
+			size_t numResults;
+			{
+				const auto nodeLock = lock(joined->mutex);
+				_add_continuation(*joined, f);
+				if (_recording) {
+					joined->callers.push_back(_current);
+				}
+				numResults = joined->results.size();
+			}
+
+			for (size_t i = 0; i < numResults; ++i) {
+				size_t result;
+				{
+					const auto nodeLock = lock(joined->mutex);
+					result = joined->results[i];
+				}
+				resume(f, ParserResult{ input(result) });
+			}
+			return nullptr;
+		}
+
+		/// Whether a tail call may enter the body of node's rule at str. Each position is entered once.
+		bool enter_tail(GssNode& node, std::string_view str) {
+			const auto at = position(str);
+			if (at == node.position || node.pruned.load(std::memory_order_relaxed))
+				return false;
+			if (_beamWidth != SIZE_MAX && !_recording && !_join_beam(node, at))
+				return false;
+
+			if (_tails && at < PACKED_POSITIONS) {
+				if (!_tails->insert(_pack(node, at)))
+					return false;
+			}
+			else {
+				const auto lock = this->lock(node.mutex);
+				if (!node.tails.insert(at).second)
+					return false;
+			}
+
+			_charge(POSITION_BYTES, at);
+			return true;
+		}
+
+		/// Number of GSS nodes currently alive.
+		size_t gss_nodes() const {
+			return _nodes.size() - _freeNodes.size();
+		}
+
+		/// Input before this position is done with. Only moves with Schedule::POSITION.
+		size_t frontier() const {
+			return _frontier;
+		}
+
+		/// Furthest failures of rule bodies. Callers would only pass them on, so instead of flowing through every GSS
+		/// node above (quadratic for deeply nested input) each one is reported once for the whole parse.
+		std::vector<ParserResult> failures() const {
+			std::vector<ParserResult> failures;
+			for (auto& error : _failed) {
+				failures.push_back({ input(_failurePosition), error });
+			}
+			return failures;
+		}
+
+		void pop(GssNode& node, ParserResult result) {
+			const auto at = position(result.trail);
+			if (!result.is_success()) {
+				if (_recording) {
+					_merge_failures(node, at, { *result.error });
+				}
+				_fail(at, *result.error);
+				return;
+			}
+
+			if (node.pruned.load(std::memory_order_relaxed))
+				return;
+			if (_beamWidth != SIZE_MAX && !_recording && !_join_beam(node, at))
+				return;
+			if (_popped && at < PACKED_POSITIONS && !_popped->insert(_pack(node, at)))
+				return;
+
+			size_t numContinuations;
+			{
+				const auto lock = this->lock(node.mutex);
+				if ((!_popped || at >= PACKED_POSITIONS) && !node.popped.insert(at).second)
+					return;
+
+				if (_limited) {
+					if (_results.fetch_add(1, std::memory_order_relaxed) >= _maxResults)
+						throw BudgetExceeded(ParseStopped::Reason::RESULTS, at, _maxResults);
+					_charge(node.evicted ? POSITION_BYTES : POSITION_BYTES + RESULT_BYTES, at);
+				}
+
+				// Results are only kept for calls that join the node later.
+				if (!node.evicted) {
+					node.results.push_back(at);
+				}
+				numContinuations = node.continuations.size();
+			}
+
+			// Continuations added meanwhile got the result from call(). Other threads may be adding more, so the
+			// iterator never moves past the ones counted.
+			auto continuation = node.continuations.begin();
+			for (size_t i = 0; i < numContinuations; ++i) {
+				if (i > 0) {
+					++continuation;
+				}
+
+				if (_recording) {
+					// The continuation reads input on behalf of the call it was added from.
+					const auto current = std::exchange(_current, node.callers[i]);
+					resume(*continuation, result);
+					_current = current;
+				}
+				else {
+					resume(*continuation, result);
+				}
+			}
+		}
+
+		/// Hand result to continuation f. Past max_depth nested continuations the call is queued instead, so it
+		/// runs once the native stack has unwound.
+		template<typename F>
+		void resume(const F& f, ParserResult result) {
+			auto& depth = _nesting();
+			if (depth >= _maxDepth) {
+				if constexpr (std::is_same_v<F, Continuation>) {
+					const auto ret = f.template target<Return>();
+					if (ret != nullptr && result.is_success()) {
+						// The Trampoline itself identifies its slot for successful returns.
+						add(slot(this, {}, [](Trampoline& trampoline, std::string_view str, GssNode* node) {
+							trampoline.resume(Return{ node }, ParserResult{ str });
+						}), result.trail, ret->node);
+						return;
+					}
+				}
+
+				add(result.trail, [f, result](Trampoline& trampoline, std::string_view) {
+					trampoline.resume(f, result);
+				});
+				return;
+			}
+
+			++depth;
+			f(*this, result);
+			--depth;
+		}
+
+		/// Slot running f, which is created once per code and layout. f may not capture anything that differs
+		/// between descriptors, that's what their position and node are for.
+		template<typename F>
+		uint32_t slot(const void* code, std::string_view layout, F f) {
+			const SlotKey key{ code, layout.data(), layout.size() };
+			const auto lock = this->lock(_slotMutex);
+			const auto id = _slotIds.emplace(key, static_cast<uint32_t>(_slots.size()));
+			if (id.second) {
+				_slots.push_back({ f, true });
+			}
+			return *id.first;
+		}
+
+		/// Queue slot at str for node. The descriptor ranks by weight and the weight of node's rule, see
+		/// Schedule::BEST_FIRST.
+		void add(uint32_t slot, std::string_view str, GssNode* node = nullptr, int weight = 0) {
+			if (_halted.load(std::memory_order_relaxed))
+				return;
+
+			if (node != nullptr) {
+				++node->references;
+			}
+
+			_push({ slot, node != nullptr ? node->index : Descriptor::NO_NODE, position(str) }, node != nullptr ? node->weight + weight : weight);
+		}
+
+		/// Queue f(trampoline, str) in a slot of its own, which is released after it ran.
+		template<typename F>
+		void add(std::string_view str, F f, int weight = 0) {
+			if (_halted.load(std::memory_order_relaxed))
+				return;
+
+			add(_single_slot(f), str, nullptr, weight);
+		}
+
+		/// Descriptors between checks of the clock and the cancellation token.
+		static constexpr size_t STOP_CHECK_INTERVAL = 256;
+
+		/// Descriptors run_for() runs between reads of the clock.
+		static constexpr size_t SLICE_CHECK_INTERVAL = 16;
+
+		void run() {
+			run_for(SIZE_MAX);
+		}
+
+		/// Run at most maxDescriptors descriptors, and stop after about time. The pending work stays queued, the next
+		/// call of run_for() or run() continues exactly where this one stopped. Returns whether no work is pending.
+		bool run_for(size_t maxDescriptors, std::chrono::steady_clock::duration time = std::chrono::steady_clock::duration::max()) {
+			const auto now = std::chrono::steady_clock::now();
+			const auto until = time < std::chrono::steady_clock::time_point::max() - now ? now + time : std::chrono::steady_clock::time_point::max();
+			const auto timed = until != std::chrono::steady_clock::time_point::max();
+
+			if (!_workers.empty()) {
+				_run_parallel(maxDescriptors, timed ? until : std::chrono::steady_clock::time_point::max());
+				return _pending.load(std::memory_order_acquire) == 0;
+			}
+
+			for (size_t ran = 0; !_queue.empty(); ++ran) {
+				if (_halted.load(std::memory_order_relaxed)) {
+					_queue.clear();
+					break;
+				}
+				if (ran == maxDescriptors || (timed && ran % SLICE_CHECK_INTERVAL == SLICE_CHECK_INTERVAL - 1 && std::chrono::steady_clock::now() >= until))
+					return false;
+
+				const auto descriptor = _queue.take();
+				_check_stop(descriptor);
+				const auto frontier = std::min<size_t>(descriptor.position, _suspendedMin);
+				if (_queue.schedule() == Schedule::POSITION && !_recording && frontier >= _frontier + RECLAIM_INTERVAL) {
+					_reclaim(frontier);
+				}
+
+				_execute(descriptor);
+				_collect();
+			}
+
+			// All that's left waits for more input.
+			if (_queue.schedule() == Schedule::POSITION && !_recording && _suspendedMin != SIZE_MAX && _suspendedMin > _frontier) {
+				_reclaim(_suspendedMin);
+			}
+			return true;
+		}
+
+		/// Whether the parse settled for the first parse, see ParseOptions::degrade_after.
+		bool degraded() const {
+			return _degraded.load(std::memory_order_relaxed);
+		}
+
+		/// See ParseOptions::furthest_results.
+		bool furthest_results() const {
+			return _furthestResults;
+		}
+
+		/// Whether the parse is done early: pending work is dropped and no more is queued.
+		bool halted() const {
+			return _halted.load(std::memory_order_relaxed);
+		}
+
+		void halt() {
+			_halted = true;
+		}
+
+		/// Times the beam turned a GSS node away or pruned one so far, see ParseOptions::beam_width.
+		size_t pruned() const {
+			return _pruned.load(std::memory_order_relaxed);
+		}
+
+		/// Most bytes the parse held at once so far, as estimated for ParseOptions::max_memory. Only counted if the
+		/// options set a budget, a timeout, a cancellation or degrade_after.
+		size_t peak_memory() const {
+			return _peakMemory.load(std::memory_order_relaxed);
+		}
+
+		/// Descriptors queued and not run yet.
+		size_t pending() const {
+			return _workers.empty() ? _queue.size() : _pending.load(std::memory_order_acquire);
+		}
+
+	private:
+		/// The coroutine backend keeps its own GSS, with the budgets and failures of the parse.
+		friend class CoroutineScheduler;
+		friend class FrameArena;
+
+		/// Continuations refer to other nodes, drop them while all nodes still exist.
+		void _drop_continuations() {
+			_slots.clear();
+			for (auto& node : _nodes) {
+				if (node != nullptr) {
+					_clear_continuations(*node);
+				}
+			}
+		}
+
+		/// Add f to node's continuations, in the list entry of a dropped one if there is one.
+		void _add_continuation(GssNode& node, Continuation f) {
+			_charge(CONTINUATION_BYTES + f.heap_size(), node.position);
+			if (_workers.empty() && !_spareContinuations.empty()) {
+				node.continuations.splice(node.continuations.end(), _spareContinuations, _spareContinuations.begin());
+				node.continuations.back() = std::move(f);
+				return;
+			}
+			node.continuations.push_back(std::move(f));
+		}
+
+		/// Drop node's continuations, keeping their list entries for _add_continuation() unless several threads run
+		/// the parse.
+		void _clear_continuations(GssNode& node) {
+			for (auto& continuation : node.continuations) {
+				continuation = nullptr;
+			}
+			if (_workers.empty()) {
+				_spareContinuations.splice(_spareContinuations.end(), node.continuations);
+			}
+			else {
+				node.continuations.clear();
+			}
+		}
+
+		template<typename F>
+		uint32_t _single_slot(F f) {
+			const auto run = [f, current = _current](Trampoline& trampoline, std::string_view str, GssNode*) {
+				if (trampoline._recording) {
+					trampoline._current = current;
+				}
+				f(trampoline, str);
+			};
+			// The closure is on the heap, with the allocator's bookkeeping.
+			constexpr size_t bytes = sizeof(SlotEntry) + sizeof(run) + 2 * sizeof(void*);
+			_charge(bytes, _frontier);
+			Slot code = run;
+
+			const auto lock = this->lock(_slotMutex);
+			if (!_freeSlots.empty()) {
+				const auto id = _freeSlots.back();
+				_freeSlots.pop_back();
+				_slots[id].code = std::move(code);
+				_slots[id].bytes = bytes;
+				return id;
+			}
+
+			_slots.push_back({ std::move(code), false, bytes });
+			return static_cast<uint32_t>(_slots.size() - 1);
+		}
+
+		void _push(Descriptor descriptor, int weight = 0) {
+			_charge(DESCRIPTOR_BYTES, descriptor.position);
+			if (_workers.empty()) {
+				_queue.push(descriptor, weight);
+				return;
+			}
+
+			_pending.fetch_add(1, std::memory_order_relaxed);
+			_workers[_worker()].deque.push(descriptor);
+		}
+
+		/// Run the code of descriptor, then drop its reference to its node.
+		void _execute(const Descriptor& descriptor) {
+			const auto str = input(descriptor.position);
+			GssNode* node = nullptr;
+			if (descriptor.node != Descriptor::NO_NODE) {
+				const auto lock = this->lock(_nodeMutex);
+				node = _nodes[descriptor.node].get();
+			}
+
+			// Shared slots stay where they are, single ones are free to be reused as soon as their code is taken.
+			const Slot* shared = nullptr;
+			Slot single;
+			size_t bytes = DESCRIPTOR_BYTES;
+			{
+				const auto lock = this->lock(_slotMutex);
+				auto& slot = _slots[descriptor.slot];
+				if (slot.shared) {
+					shared = &slot.code;
+				}
+				else {
+					single = std::move(slot.code);
+					bytes += slot.bytes;
+					_freeSlots.push_back(descriptor.slot);
+				}
+			}
+			_refund(bytes);
+
+			if (node != nullptr && node->pruned.load(std::memory_order_relaxed)) {
+				// Work of pruned nodes is dropped.
+			}
+			else if (shared != nullptr) {
+				// Shared slots run rule bodies, on behalf of the node.
+				if (_recording) {
+					_current = node;
+				}
+				(*shared)(*this, str, node);
+			}
+			else {
+				single(*this, str, node);
+			}
+
+			if (node != nullptr) {
+				_release(*node);
+			}
+		}
+
+		/// Every worker takes descriptors from its own deque, most recent first, and steals the oldest ones of a
+		/// random other worker once it's empty. The parse is done when no descriptor is queued or running anymore.
+		/// Run descriptors on all workers until none are pending, maxDescriptors ran or until passed. Workers that
+		/// stop early leave their descriptors in their deques for the next call.
+		void _run_parallel(size_t maxDescriptors, std::chrono::steady_clock::time_point until) {
+			std::atomic<bool> failed{ false };
+			std::atomic<bool> stopped{ false };
+			std::atomic<size_t> ran{ 0 };
+			std::exception_ptr error;
+			std::mutex errorMutex;
+
+			const auto work = [&](size_t worker) {
+				const auto previous = std::exchange(_running, { this, worker });
+				try {
+					std::minstd_rand random{ static_cast<uint32_t>(worker + 1) };
+					auto& own = _workers[worker].deque;
+					for (size_t iteration = 0; _pending.load(std::memory_order_acquire) > 0 && !failed.load(std::memory_order_relaxed); ++iteration) {
+						if (stopped.load(std::memory_order_relaxed) || _halted.load(std::memory_order_relaxed))
+							break;
+						if (until != std::chrono::steady_clock::time_point::max() && iteration % SLICE_CHECK_INTERVAL == SLICE_CHECK_INTERVAL - 1
+							&& std::chrono::steady_clock::now() >= until) {
+							stopped = true;
+							break;
+						}
+
+						auto descriptor = own.pop();
+						for (size_t attempt = 0; !descriptor && attempt < _workers.size(); ++attempt) {
+							descriptor = _workers[random() % _workers.size()].deque.steal();
+						}
+
+						if (!descriptor) {
+							std::this_thread::yield();
+							continue;
+						}
+
+						// Over the limit, the descriptor goes back for the next call.
+						if (maxDescriptors != SIZE_MAX && ran.fetch_add(1, std::memory_order_relaxed) >= maxDescriptors) {
+							own.push(*descriptor);
+							stopped = true;
+							break;
+						}
+
+						_check_stop(*descriptor);
+						_execute(*descriptor);
+						_pending.fetch_sub(1, std::memory_order_release);
+					}
+				}
+				catch (...) {
+					std::lock_guard<std::mutex> lock{ errorMutex };
+					if (!error) {
+						error = std::current_exception();
+					}
+					failed = true;
+				}
+				_running = previous;
+			};
+
+			std::vector<std::thread> threads;
+			const auto join = [&threads]() {
+				for (auto& thread : threads) {
+					thread.join();
+				}
+			};
+
+			try {
+				for (size_t i = 1; i < _workers.size(); ++i) {
+					threads.emplace_back(work, i);
+				}
+			}
+			catch (...) {
+				failed = true;
+				join();
+				throw;
+			}
+			work(0);
+			join();
+
+			// No thread steals anymore.
+			for (auto& worker : _workers) {
+				worker.deque.reclaim();
+			}
+
+			if (error) {
+				std::rethrow_exception(error);
+			}
+
+			if (_halted) {
+				for (auto& worker : _workers) {
+					worker.deque.clear();
+				}
+				_pending = 0;
+			}
+		}
+
+		/// Start counting the steps and time of a parse.
+		void _start() {
+			_steps = 0;
+			_results = 0;
+			_memory = 0;
+			_peakMemory = 0;
+			_degraded = false;
+			_halted = false;
+			_pruned = 0;
+			const auto now = std::chrono::steady_clock::now();
+			_deadline = _timeout < std::chrono::steady_clock::time_point::max() - now ? now + _timeout : std::chrono::steady_clock::time_point::max();
+		}
+
+		/// Throw ParseStopped if the parse may not run descriptor.
+		void _check_stop(const Descriptor& descriptor) {
+			if (!_limited)
+				return;
+
+			const auto steps = _steps.fetch_add(1, std::memory_order_relaxed);
+			if (steps >= _maxSteps)
+				throw BudgetExceeded(ParseStopped::Reason::STEPS, descriptor.position, _maxSteps);
+			if (steps == _degradeAfter) {
+				_degraded = true;
+			}
+			if (steps % STOP_CHECK_INTERVAL != 0)
+				return;
+
+			if (_cancellation && _cancellation->cancelled())
+				throw ParseStopped(ParseStopped::Reason::CANCELLED, descriptor.position);
+			if (std::chrono::steady_clock::now() >= _deadline)
+				throw ParseStopped(ParseStopped::Reason::TIMEOUT, descriptor.position);
+		}
+
+		/// Estimated bytes of a GSS node and of the entries of its containers, see ParseOptions::max_memory.
+		static constexpr size_t NODE_BYTES = sizeof(GssNode);
+		static constexpr size_t CONTINUATION_BYTES = sizeof(Continuation) + 2 * sizeof(void*);
+		/// Hash set entries take a node and a bucket, result vectors are up to half full.
+		static constexpr size_t POSITION_BYTES = sizeof(size_t) + 3 * sizeof(void*);
+		static constexpr size_t RESULT_BYTES = 2 * sizeof(size_t);
+		/// Estimated bytes of a queued descriptor, queues hold up to twice the descriptors they have room for. Single
+		/// slots are estimated by _single_slot().
+		static constexpr size_t DESCRIPTOR_BYTES = 2 * sizeof(Descriptor);
+		/// Estimated bytes of an entry of _failed, on top of its text.
+		static constexpr size_t FAILURE_BYTES = sizeof(std::string) + 4 * sizeof(void*);
+
+		/// Account for bytes more the GSS holds because of something at position, throws BudgetExceeded if that's
+		/// over the budget.
+		void _charge(size_t bytes, size_t position) {
+			if (!_limited)
+				return;
+
+			const auto memory = _memory.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+			for (auto peak = _peakMemory.load(std::memory_order_relaxed); memory > peak && !_peakMemory.compare_exchange_weak(peak, memory, std::memory_order_relaxed);) {
+			}
+			if (memory > _maxMemory)
+				throw BudgetExceeded(ParseStopped::Reason::MEMORY, position, _maxMemory);
+		}
+
+		void _refund(size_t bytes) {
+			if (_limited) {
+				_memory.fetch_sub(std::min(bytes, _memory.load(std::memory_order_relaxed)), std::memory_order_relaxed);
+			}
+		}
+
+		static size_t _footprint(const GssNode& node) {
+			auto bytes = NODE_BYTES + node.results.size() * RESULT_BYTES + (node.popped.size() + node.tails.size()) * POSITION_BYTES;
+			for (auto& continuation : node.continuations) {
+				bytes += CONTINUATION_BYTES + continuation.heap_size();
+			}
+			return bytes;
+		}
+
+		/// Positions below this are kept in _popped and _tails together with the index of their node.
+		static constexpr size_t PACKED_POSITIONS = size_t{ 1 } << 31;
+
+		static uint64_t _pack(const GssNode& node, size_t position) {
+			return static_cast<uint64_t>(node.index) << 31 | position;
+		}
+
+		/// Worker the calling thread is, threads that don't run this Trampoline's descriptors count as the first.
+		size_t _worker() const {
+			return _running.first == this ? _running.second : 0;
+		}
+
+		/// Continuations nested on the native stack of the calling thread.
+		size_t& _nesting() {
+			return _workers.empty() ? _depth : _workers[_worker()].depth;
+		}
+
+		GssNode* _new_node(const void* rule, std::string_view layout, size_t position, int weight) {
+			const auto lock = this->lock(_nodeMutex);
+			if (_limited) {
+				if (_nodes.size() - _freeNodes.size() >= _maxGssNodes)
+					throw BudgetExceeded(ParseStopped::Reason::GSS_NODES, position, _maxGssNodes);
+				_charge(NODE_BYTES, position);
+			}
+
+			uint32_t index;
+			if (!_freeNodes.empty()) {
+				index = _freeNodes.back();
+				_freeNodes.pop_back();
+			}
+			else {
+				index = static_cast<uint32_t>(_nodes.size());
+				_nodes.emplace_back();
+			}
+
+			if (_spareNodes.empty()) {
+				_nodes[index].reset(new GssNode{ this, rule, layout, position, index, weight, _serial++ });
+				return _nodes[index].get();
+			}
+
+			// Nodes of earlier parses keep the capacity of their containers.
+			auto& node = *(_nodes[index] = std::move(_spareNodes.back()));
+			_spareNodes.pop_back();
+			node.owner = this;
+			node.rule = rule;
+			node.layout = layout;
+			node.position = position;
+			node.index = index;
+			node.weight = weight;
+			node.serial = _serial++;
+			node.pruned = false;
+			node.references = 0;
+			node.evicted = false;
+			node.results.clear();
+			node.popped.clear();
+			node.tails.clear();
+			node.callers.clear();
+			node.examined = 0;
+			node.failurePosition = 0;
+			node.failures.clear();
+			return &node;
+		}
+
+		/// Report a failure of a rule body to the parse.
+		void _fail(size_t at, const std::string& error) {
+			const auto lock = this->lock(_mutex);
+			if (!_failed.empty() && at < _failurePosition)
+				return;
+
+			if (at > _failurePosition) {
+				for (auto& failed : _failed) {
+					_refund(FAILURE_BYTES + failed.size());
+				}
+				_failed.clear();
+			}
+
+			_failurePosition = at;
+			if (_failed.insert(error).second) {
+				_charge(FAILURE_BYTES + error.size(), at);
+			}
+		}
+
+		/// Keep the furthest of node's failures and errors at. Returns whether node's changed.
+		static bool _merge_failures(GssNode& node, size_t at, const std::vector<std::string>& errors) {
+			if (!node.failures.empty() && at < node.failurePosition)
+				return false;
+
+			if (node.failures.empty() || at > node.failurePosition) {
+				node.failurePosition = at;
+				node.failures = errors;
+				return true;
+			}
+
+			auto changed = false;
+			for (auto& error : errors) {
+				if (std::find(node.failures.begin(), node.failures.end(), error) == node.failures.end()) {
+					node.failures.push_back(error);
+					changed = true;
+				}
+			}
+			return changed;
+		}
+
+		/// Answer a call from the memo of an earlier parse, without a GSS node. What it looked at and its failures
+		/// count for the calling node as if the body had run.
+		void _answer(const Memo& memo, const Continuation& f) {
+			++_reused;
+			read(memo.examined);
+			if (_current != nullptr && !memo.failures.empty()) {
+				_merge_failures(*_current, memo.failurePosition, memo.failures);
+			}
+			for (auto& error : memo.failures) {
+				_fail(memo.failurePosition, error);
+			}
+			for (auto result : memo.results) {
+				resume(f, ParserResult{ input(result) });
+			}
+		}
+
+		const Memo* _find_memo(const void* rule, std::string_view layout, size_t position) const {
+			if (_reuse == nullptr)
+				return nullptr;
+
+			auto it = std::lower_bound(_reuse->begin(), _reuse->end(), position, [](const Memo& memo, size_t position) {
+				return memo.position < position;
+			});
+			for (; it != _reuse->end() && it->position == position; ++it) {
+				if (it->rule == rule && it->layout.data() == layout.data() && it->layout.size() == layout.size())
+					return &*it;
+			}
+			return nullptr;
+		}
+
+		/// Input distance the frontier has to advance by before memory is reclaimed again.
+		static constexpr size_t RECLAIM_INTERVAL = 4096;
+
+		/// _new_node() if the node gets into the beam of its position, otherwise nullptr. New nodes rank behind the
+		/// others of their weight.
+		GssNode* _new_beam_node(const void* rule, std::string_view layout, size_t position, int weight) {
+			const auto lock = this->lock(_beamMutex);
+			if (!_enter_beam(weight, UINT64_MAX, position))
+				return nullptr;
+
+			const auto node = _new_node(rule, layout, position, weight);
+			_beam(position).push_back({ node, weight, node->serial });
+			return node;
+		}
+
+		/// Whether node may return or enter its rule body at position, which puts it into the beam of position.
+		bool _join_beam(GssNode& node, size_t position) {
+			const auto lock = this->lock(_beamMutex);
+			const auto& beam = _beam(position);
+			if (std::find_if(beam.begin(), beam.end(), [&](const BeamEntry& entry) {
+				return entry.node == &node && entry.serial == node.serial;
+			}) != beam.end())
+				return true;
+			if (!_enter_beam(node.weight, node.serial, position))
+				return false;
+
+			_beam(position).push_back({ &node, node.weight, node.serial });
+			return true;
+		}
+
+		/// Whether a node of weight and serial has a place in the beam of position, pruning the last ranking node of
+		/// a full one if it ranks behind. The caller adds the node.
+		bool _enter_beam(int weight, uint64_t serial, size_t position) {
+			auto& beam = _beam(position);
+			beam.erase(std::remove_if(beam.begin(), beam.end(), [](const BeamEntry& entry) {
+				return entry.current() && entry.node->pruned.load(std::memory_order_relaxed);
+			}), beam.end());
+			if (beam.size() < _beamWidth)
+				return true;
+
+			const auto behind = [](int weight, uint64_t serial, const BeamEntry& entry) {
+				return weight < entry.weight || (weight == entry.weight && serial > entry.serial);
+			};
+			auto last = beam.begin();
+			for (auto it = beam.begin(); it != beam.end(); ++it) {
+				if (behind(it->weight, it->serial, *last)) {
+					last = it;
+				}
+			}
+
+			++_pruned;
+			if (behind(weight, serial, *last))
+				return false;
+
+			if (last->current()) {
+				last->node->pruned = true;
+			}
+			beam.erase(last);
+			return true;
+		}
+
+		/// Node in the beam of a position. Nodes freed by _collect() keep their place in the beams of the positions
+		/// not reclaimed yet, as finished nodes do, but _new_node() may reuse them for another call, so the entry
+		/// ranks by the weight and serial it entered with and only refers to the node while the serial is unchanged.
+		struct BeamEntry {
+			GssNode* node;
+			int weight;
+			uint64_t serial;
+
+			bool current() const {
+				return node->serial == serial;
+			}
+		};
+
+		/// Nodes active at position.
+		std::vector<BeamEntry>& _beam(size_t position) {
+			if (const auto id = _beamIds.find(position))
+				return _beams[*id];
+
+			uint32_t id;
+			if (!_freeBeams.empty()) {
+				id = _freeBeams.back();
+				_freeBeams.pop_back();
+			}
+			else {
+				if (_beamsUsed == _beams.size()) {
+					_beams.emplace_back();
+				}
+				id = static_cast<uint32_t>(_beamsUsed++);
+			}
+
+			_beamIds.emplace(position, id);
+			_beams[id].clear();
+			return _beams[id];
+		}
+
+		/// Drop a reference to node. Nodes no call can join anymore are freed once the last one is gone.
+		void _release(GssNode& node) {
+			if (--node.references == 0 && node.evicted) {
+				_dead.push_back(node.index);
+			}
+		}
+
+		/// Free dead nodes. Their continuations may release further nodes, which is why this loops instead of
+		/// recursing.
+		void _collect() {
+			while (!_dead.empty()) {
+				const auto index = _dead.back();
+				_dead.pop_back();
+
+				// Releases the nodes the continuations return to.
+				_refund(_footprint(*_nodes[index]));
+				_clear_continuations(*_nodes[index]);
+				_spareNodes.push_back(std::move(_nodes[index]));
+				_freeNodes.push_back(index);
+			}
+		}
+
+		/// No descriptor before frontier is pending, and all work starts at a descriptor and moves forward, so
+		/// nothing will be called, popped or lexed before it anymore.
+		void _reclaim(size_t frontier) {
+			_frontier = frontier;
+
+			for (size_t i = 0; i < _stripes; ++i) {
+				_gss[i].nodes.erase_if([&](const GssKey&, GssNode* node) {
+					if (node->position >= frontier)
+						return false;
+
+					node->evicted = true;
+					_refund(node->results.size() * RESULT_BYTES);
+					node->results = {};
+					if (node->references == 0) {
+						_dead.push_back(node->index);
+					}
+					return true;
+				});
+			}
+
+			for (auto& node : _nodes) {
+				if (node == nullptr)
+					continue;
+
+				const auto positions = node->popped.size() + node->tails.size();
+				_erase_before(node->popped, frontier);
+				_erase_before(node->tails, frontier);
+				_refund((positions - node->popped.size() - node->tails.size()) * POSITION_BYTES);
+			}
+
+			_lexed.erase_if([&](const LexKey& key, const Lexed&) {
+				if (key.position >= frontier)
+					return false;
+
+				_refund(LEXED_BYTES);
+				return true;
+			});
+			_beamIds.erase_if([&](size_t position, uint32_t id) {
+				if (position >= frontier)
+					return false;
+
+				_freeBeams.push_back(id);
+				return true;
+			});
+
+			_collect();
+			if (_reclaimed) {
+				_reclaimed();
+			}
+		}
+
+		static void _erase_before(std::unordered_set<size_t>& positions, size_t frontier) {
+			for (auto it = positions.begin(); it != positions.end();) {
+				it = *it < frontier ? positions.erase(it) : std::next(it);
+			}
+		}
+
+		struct Segment {
+			std::string_view text;
+			size_t position;
+		};
+
+		struct SlotEntry {
+			Slot code;
+			/// Shared slots are kept for the whole parse, the others run once.
+			bool shared;
+			/// Estimated bytes of single slots, see ParseOptions::max_memory.
+			size_t bytes;
+		};
+
+		struct SlotKey {
+			const void* code;
+			const char* layout;
+			size_t layoutSize;
+
+			bool operator==(const SlotKey& other) const {
+				return code == other.code && layout == other.layout && layoutSize == other.layoutSize;
+			}
+		};
+
+		struct SlotKeyHash {
+			size_t operator()(const SlotKey& key) const {
+				return std::hash<const void*>{}(key.code) ^ std::hash<const void*>{}(key.layout) ^ key.layoutSize;
+			}
+		};
+
+		struct LexKey {
+			const void* lexer;
+			size_t position;
+			uint16_t set;
+
+			bool operator==(const LexKey& other) const {
+				return lexer == other.lexer && position == other.position && set == other.set;
+			}
+		};
+
+		struct GssKey {
+			const void* rule;
+			const char* layout;
+			size_t layoutSize;
+			size_t position;
+
+			bool operator==(const GssKey& other) const {
+				return rule == other.rule && layout == other.layout && layoutSize == other.layoutSize && position == other.position;
+			}
+		};
+
+		struct GssKeyHash {
+			size_t operator()(const GssKey& key) const {
+				return std::hash<const void*>{}(key.rule) ^ std::hash<const void*>{}(key.layout) ^ (key.position * 0x9E3779B97F4A7C15ull);
+			}
+		};
+
+		struct LexKeyHash {
+			size_t operator()(const LexKey& key) const {
+				return std::hash<const void*>{}(key.lexer) ^ (key.position * 0x9E3779B97F4A7C15ull) ^ key.set;
+			}
+		};
+
+		/// Part of the GSS with a lock of its own, there are several if several threads run the parse.
+		struct GssStripe {
+			std::mutex mutex;
+			GenerationMap<GssKey, GssNode*, GssKeyHash> nodes;
+		};
+
+		static constexpr size_t GSS_STRIPES = 16;
+
+		GssStripe& _stripe(const GssKey& key) {
+			// High bits, the ones the hash tables of the stripes use the least.
+			return _gss[static_cast<size_t>((static_cast<uint64_t>(GssKeyHash{}(key)) * 0x9E3779B97F4A7C15ull) >> 60) % _stripes];
+		}
+
+		struct alignas(64) Worker {
+			StealingDeque deque;
+			size_t depth = 0;
+		};
+
+		std::string_view _str;
+		size_t _base = 0;
+		/// Segments of segmented input by position, and their indices by address.
+		std::vector<Segment> _segments;
+		std::vector<uint32_t> _byAddress;
+		/// Segment of the last lookup, which is usually the next one's too.
+		mutable std::atomic<size_t> _segment{ 0 };
+		bool _complete = true;
+		const TokenStream* _tokens;
+		size_t _maxDepth;
+		size_t _depth = 0;
+		DescriptorQueue _queue;
+		std::vector<Descriptor> _suspended;
+		size_t _suspendedMin = SIZE_MAX;
+		/// Addresses are stable, slots may queue more while they run.
+		std::deque<SlotEntry> _slots;
+		std::vector<uint32_t> _freeSlots;
+		GenerationMap<SlotKey, uint32_t, SlotKeyHash> _slotIds;
+		/// GSS nodes by index, owned here so nodes that are still referenced after their eviction stay alive.
+		std::vector<std::unique_ptr<GssNode>> _nodes;
+		std::vector<uint32_t> _freeNodes;
+		/// Freed nodes and list entries of dropped continuations, reused by later calls and parses.
+		std::vector<std::unique_ptr<GssNode>> _spareNodes;
+		std::list<Continuation> _spareContinuations;
+		std::vector<uint32_t> _dead;
+		size_t _frontier = 0;
+		/// Run by _reclaim(), the coroutine backend reclaims its own GSS there.
+		std::function<void()> _reclaimed;
+		struct Lexed {
+			std::pair<size_t, int32_t> result;
+			size_t examined;
+		};
+
+		/// Estimated bytes of an entry of _lexed, whose table is up to half full.
+		static constexpr size_t LEXED_BYTES = 2 * (sizeof(size_t) + sizeof(LexKey) + sizeof(Lexed));
+
+		GenerationMap<LexKey, Lexed, LexKeyHash> _lexed;
+		/// Beam of each position, see ParseOptions::beam_width. The vectors of _beams keep their capacity, the ones
+		/// from _beamsUsed on and the ones of reclaimed positions in _freeBeams are unused.
+		GenerationMap<size_t, uint32_t, std::hash<size_t>> _beamIds;
+		std::vector<std::vector<BeamEntry>> _beams;
+		size_t _beamsUsed = 0;
+		std::vector<uint32_t> _freeBeams;
+		uint64_t _serial = 0;
+		std::unique_ptr<GssStripe[]> _gss;
+		size_t _stripes;
+		std::set<std::string> _failed;
+		size_t _failurePosition = 0;
+		bool _recording = false;
+		const std::vector<Memo>* _reuse = nullptr;
+		size_t _reused = 0;
+		/// Node of the rule call the running code belongs to.
+		GssNode* _current = nullptr;
+		/// Furthest read() since lex() started its scan.
+		mutable size_t _watermark = 0;
+		/// Limits of ParseOptions, _limited if there are any.
+		size_t _maxSteps;
+		std::chrono::steady_clock::duration _timeout;
+		std::optional<CancellationToken> _cancellation;
+		size_t _maxGssNodes;
+		size_t _maxResults;
+		size_t _maxMemory;
+		size_t _degradeAfter;
+		size_t _beamWidth;
+		bool _furthestResults;
+		bool _limited;
+		/// Whether the parse settled for the first parse, and found it.
+		std::atomic<bool> _degraded{ false };
+		std::atomic<bool> _halted{ false };
+		std::atomic<size_t> _pruned{ 0 };
+		std::atomic<size_t> _steps{ 0 };
+		std::atomic<size_t> _results{ 0 };
+		std::atomic<size_t> _memory{ 0 };
+		std::atomic<size_t> _peakMemory{ 0 };
+		std::chrono::steady_clock::time_point _deadline;
+		/// Workers if several threads run the parse, and descriptors queued or running on them.
+		std::deque<Worker> _workers;
+		std::atomic<size_t> _pending{ 0 };
+		/// Positions popped from and entered by tail calls of nodes, instead of their own sets if several threads
+		/// run the parse.
+		std::optional<ConcurrentKeySet> _popped;
+		std::optional<ConcurrentKeySet> _tails;
+		/// Guard the containers named after them, _mutex the suspended descriptors and failures. Only taken if
+		/// several threads run the parse.
+		std::mutex _slotMutex;
+		std::mutex _nodeMutex;
+		std::mutex _lexMutex;
+		std::mutex _beamMutex;
+		std::mutex _mutex;
+		/// Trampoline and worker the calling thread runs descriptors for.
+		static inline thread_local std::pair<const Trampoline*, size_t> _running{ nullptr, 0 };
+	};
+
+
+
+
+	/// Collects the NFA of a rule body. References back to a rule that is currently being built are
+	/// only allowed in tail position, i.e. the rules must be right-linear and therefore regular.
+	class RegularBuilder {
+	public:
+		struct Fragment {
+			uint32_t start;
+			uint32_t end;
+		};
+
+		RegularBuilder(size_t maxStates = 1 << 14)
+			: _maxStates(maxStates) {
+		}
+
+		Fragment empty() {
+			const auto state = nfa.add_state();
+			return { state, state };
+		}
+
+		Fragment literal(std::string_view what) {
+			const auto start = nfa.add_state();
+			auto end = start;
+			for (auto c : what) {
+				const auto next = nfa.add_state();
+				nfa.add_edge(end, chars({ &c, 1 }), next);
+				end = next;
+			}
+			return { start, end };
+		}
+
+		/// Consume bytes in set for as long as possible.
+		Fragment greedy(CharSet set) {
+			const auto start = nfa.add_state();
+			const auto end = nfa.add_state();
+			nfa.add_edge(start, set, start);
+			nfa.add_epsilon(start, end, ~set);
+			return { start, end };
+		}
+
+		Fragment then(Fragment lhs, Fragment rhs) {
+			nfa.add_epsilon(lhs.end, rhs.start);
+			return { lhs.start, rhs.end };
+		}
+
+		Fragment either(Fragment lhs, Fragment rhs) {
+			const auto start = nfa.add_state();
+			const auto end = nfa.add_state();
+			nfa.add_epsilon(start, lhs.start);
+			nfa.add_epsilon(start, rhs.start);
+			nfa.add_epsilon(lhs.end, end);
+			nfa.add_epsilon(rhs.end, end);
+			return { start, end };
+		}
+
+		/// Everything built until restore_tail() is followed by more input, so enclosing rules may not recurse from there.
+		std::vector<bool> leave_tail() {
+			std::vector<bool> tails;
+			for (auto& rule : _rules) {
+				tails.push_back(rule.tail);
+				rule.tail = false;
+			}
+			return tails;
+		}
+
+		void restore_tail(const std::vector<bool>& tails) {
+			for (size_t i = 0; i < tails.size(); ++i) {
+				_rules[i].tail = tails[i];
+			}
+		}
+
+		template<typename F>
+		std::optional<Fragment> rule(const void* id, std::string_view layout, F body) {
+			for (auto& rule : _rules) {
+				if (rule.id != id)
+					continue;
+
+				if (!rule.tail || rule.layout != layout)
+					return std::nullopt;
+
+				// Tail recursion loops back to the start of the rule, the rest of this path is dead.
+				const auto start = nfa.add_state();
+				nfa.add_epsilon(start, rule.start);
+				return Fragment{ start, nfa.add_state() };
+			}
+
+			if (full())
+				return std::nullopt;
+
+			const auto start = nfa.add_state();
+			_rules.push_back({ id, layout, start, true });
+			const auto fragment = body();
+			_rules.pop_back();
+
+			if (!fragment)
+				return std::nullopt;
+
+			nfa.add_epsilon(start, fragment->start);
+			return Fragment{ start, fragment->end };
+		}
+
+		/// Whether the NFA grew too large to continue inlining.
+		bool full() const {
+			return nfa.size() > _maxStates;
+		}
+
+		Nfa nfa;
+
+	private:
+		struct Rule {
+			const void* id;
+			std::string_view layout;
+			uint32_t start;
+			bool tail;
+		};
+
+		std::vector<Rule> _rules;
+		size_t _maxStates;
+	};
+
+
+
+
+	using TokenSet = std::bitset<256>;
+
+	/// FIRST sets of rules and the set of tokens expected wherever a TokenParser is used, see Lexer::analyze.
+	class TokenAnalysis {
+	public:
+		struct Rule {
+			TokenSet first;
+			bool nullable = false;
+			/// Tokens expected where the rule is called and after it returns.
+			TokenSet entry;
+			TokenSet follow;
+		};
+
+		bool first(const void* rule, TokenSet& first) {
+			auto& info = rules[rule];
+			first |= info.first;
+			return info.nullable;
+		}
+
+		void set_first(const void* rule, TokenSet first, bool nullable) {
+			auto& info = rules[rule];
+			if (info.first != first || info.nullable != nullable) {
+				info.first = first;
+				info.nullable = nullable;
+				changed = true;
+			}
+		}
+
+		void call(const void* rule, TokenSet expected, TokenSet follow) {
+			auto& info = rules[rule];
+			if ((info.entry | expected) != info.entry || (info.follow | follow) != info.follow) {
+				info.entry |= expected;
+				info.follow |= follow;
+				changed = true;
+			}
+		}
+
+		void expect(const TokenParser* token, TokenSet expected) {
+			tokens[token] |= expected;
+		}
+
+		std::map<const void*, Rule> rules;
+		std::map<const TokenParser*, TokenSet> tokens;
+		bool changed = false;
+	};
+
+
+
+
+	/// Reads the input from a trail on, across segment boundaries. Reads within one segment are plain string operations.
+	class Cursor {
+	public:
+		Cursor(const Trampoline& trampoline, std::string_view str)
+			: _trampoline(trampoline)
+			, _view(str) {
+		}
+
+		/// Input from the cursor on, up to the end of its segment. Empty only at the end of the input.
+		std::string_view trail() const {
+			return _view;
+		}
+
+		bool at_end() const {
+			return _view.empty();
+		}
+
+		void advance(size_t n) {
+			_view = _trampoline.advance(_view, n);
+		}
+
+		/// Move past the chars p holds for.
+		template<typename P>
+		void skip_while(P p) {
+			for (;;) {
+				size_t i = 0;
+				while (i < _view.size() && p(_view[i]))
+					++i;
+
+				if (i < _view.size() || _view.empty()) {
+					_view = _view.substr(i);
+					_read(1);
+					return;
+				}
+				advance(i);
+			}
+		}
+
+		void skip(std::string_view layout) {
+			skip_while([layout](char c) {
+				return layout.find(c) != std::string_view::npos;
+			});
+		}
+
+		/// Move past what if the input continues with it. Otherwise the cursor is at the end if the input ended within what.
+		bool match(std::string_view what) {
+			for (size_t matched = 0; matched < what.size();) {
+				if (_view.empty()) {
+					_read(1);
+					return false;
+				}
+
+				const auto length = std::min(_view.size(), what.size() - matched);
+				if (memcmp(_view.data(), what.data() + matched, length)) {
+					_read(length);
+					return false;
+				}
+
+				matched += length;
+				if (matched == what.size()) {
+					_read(length);
+				}
+				advance(length);
+			}
+			return true;
+		}
+
+	private:
+		/// length bytes from the cursor on were looked at, or the end of the input if it's there.
+		void _read(size_t length) const {
+			if (_trampoline.recording()) {
+				_trampoline.read(_view.empty() ? _trampoline.end() + 1 : _trampoline.position(_view) + length);
+			}
+		}
+
+		const Trampoline& _trampoline;
+		std::string_view _view;
+	};
+
+
+
+
+	/// Results of a whole parse. Anything that doesn't reach the end of the input fails with "Tail left". Keeps every
+	/// success and failure, or only the furthest ones if the parse asks for that (see ParseOptions::furthest_results).
+	class ResultCollector {
+	public:
+		void add(Trampoline& trampoline, const ParserResult& result) {
+			const auto at = trampoline.position(result.trail);
+			const auto lock = trampoline.lock(_mutex);
+			if (trampoline.halted())
+				return;
+
+			if (!trampoline.furthest_results()) {
+				_position = std::max(_position, at);
+				_all.emplace_back(at, result.error);
+				_stop_if_degraded(trampoline, result, at);
+				return;
+			}
+
+			if (at < _position)
+				return;
+
+			if (at > _position) {
+				_position = at;
+				_successes = 0;
+				_errors.clear();
+			}
+
+			if (result.is_success()) {
+				++_successes;
+				_stop_if_degraded(trampoline, result, at);
+			}
+			else if (std::find(_errors.begin(), _errors.end(), *result.error) == _errors.end()) {
+				_errors.push_back(*result.error);
+			}
+		}
+
+		/// Either the successes or the failures, once the parse is done.
+		std::vector<ParserResult> results(Trampoline& trampoline) {
+			std::vector<ParserResult> results;
+			this->results(trampoline, results);
+			return results;
+		}
+
+		/// Replace the contents of results with the ones of the parse, keeping its capacity.
+		void results(Trampoline& trampoline, std::vector<ParserResult>& results) {
+			for (auto& failure : trampoline.failures()) {
+				add(trampoline, failure);
+			}
+
+			results.clear();
+			if (!trampoline.furthest_results()) {
+				// The successes if there are any, as they are only known once the input is complete.
+				const auto end = trampoline.end();
+				for (auto& [at, error] : _all) {
+					if (at == end && !error) {
+						results.push_back({ trampoline.input(end) });
+					}
+				}
+				if (!results.empty())
+					return;
+
+				for (auto& [at, error] : _all) {
+					results.push_back({ trampoline.input(at), at == end ? error : "Tail left" });
+				}
+				return;
+			}
+
+			const auto trail = trampoline.input(_position);
+			if (!trail.empty()) {
+				results.push_back({ trail, "Tail left" });
+			}
+			else if (_successes > 0) {
+				results.assign(_successes, ParserResult{ trail });
+			}
+			else {
+				for (auto& error : _errors) {
+					results.push_back({ trail, error });
+				}
+			}
+		}
+
+		/// Start collecting the results of another parse.
+		void reset() {
+			_position = 0;
+			_successes = 0;
+			_errors.clear();
+			_all.clear();
+		}
+
+		bool empty() const {
+			return _successes == 0 && _errors.empty() && _all.empty();
+		}
+
+		/// Furthest position a result was collected at.
+		size_t position() const {
+			return _position;
+		}
+
+	private:
+		/// A degraded parse is done with its first success at the end of the input.
+		static void _stop_if_degraded(Trampoline& trampoline, const ParserResult& result, size_t at) {
+			if (result.is_success() && trampoline.degraded() && !trampoline.partial() && at == trampoline.end()) {
+				trampoline.halt();
+			}
+		}
+
+		size_t _position = 0;
+		/// ParseOptions::furthest_results: the successes and distinct errors at _position.
+		size_t _successes = 0;
+		std::vector<std::string> _errors;
+		/// Otherwise the position and error of every result, in the order they came in.
+		std::vector<std::pair<size_t, std::optional<std::string>>> _all;
+		std::mutex _mutex;
+	};
+
+
+
+
+#if __cpp_impl_coroutine
+	struct ResultChannel;
+
+	/// Frames of the coroutines of a parse on the coroutine backend, see ParseOptions::coroutines. They are cut from
+	/// blocks that are freed together. A frame that is destroyed goes to a free list for its size and is reused by the
+	/// next frame of that size. The frames in use count against the parse's ParseOptions::max_memory.
+	class FrameArena {
+	public:
+		/// Links the frames that haven't been destroyed.
+		struct Link {
+			Link* prev = nullptr;
+			Link* next = nullptr;
+			std::coroutine_handle<> handle;
+			/// Channel the frame passes its positions to, and the one it waits on.
+			ResultChannel* out = nullptr;
+			ResultChannel* in = nullptr;
+			bool started = false;
+			/// Last collection that found the frame still needed, see CoroutineScheduler::_collect().
+			uint64_t mark = 0;
+		};
+
+		static constexpr size_t BLOCK_SIZE = 64 * 1024;
+
+		explicit FrameArena(Trampoline& trampoline)
+			: _trampoline(trampoline) {
+			_live.prev = &_live;
+			_live.next = &_live;
+		}
+
+		FrameArena(const FrameArena&) = delete;
+		FrameArena& operator=(const FrameArena&) = delete;
+
+		~FrameArena() {
+			while (_live.next != &_live) {
+				_live.next->handle.destroy();
+			}
+		}
+
+		/// Room for a frame of a coroutine that starts at position. Throws BudgetExceeded if that's over the budget.
+		void* allocate(size_t size, size_t position) {
+			size = _round(HEADER + size);
+			_trampoline._charge(size, position);
+			unsigned char* memory;
+			auto& free = _free[size];
+			if (free != nullptr) {
+				memory = static_cast<unsigned char*>(free) - HEADER;
+				free = *static_cast<void**>(free);
+			}
+			else {
+				if (_used + size > _capacity) {
+					_capacity = std::max(BLOCK_SIZE, size);
+					_blocks.push_back(std::make_unique<unsigned char[]>(_capacity));
+					_used = 0;
+				}
+				memory = _blocks.back().get() + _used;
+				_used += size;
+			}
+
+			*reinterpret_cast<FrameArena**>(memory) = this;
+			return memory + HEADER;
+		}
+
+		static void deallocate(void* frame, size_t size) {
+			auto& arena = **reinterpret_cast<FrameArena**>(static_cast<unsigned char*>(frame) - HEADER);
+			size = _round(HEADER + size);
+			arena._trampoline._refund(size);
+			auto& free = arena._free[size];
+			*static_cast<void**>(frame) = free;
+			free = frame;
+		}
+
+		void link(Link& link) {
+			link.prev = &_live;
+			link.next = _live.next;
+			_live.next->prev = &link;
+			_live.next = &link;
+			++_frames;
+		}
+
+		void unlink(Link& link) {
+			link.prev->next = link.next;
+			link.next->prev = link.prev;
+			--_frames;
+		}
+
+		/// Number of frames that haven't been destroyed.
+		size_t frames() const {
+			return _frames;
+		}
+
+		/// Call f with each frame that hasn't been destroyed. f may not destroy any.
+		template<typename F>
+		void each(F f) {
+			for (auto link = _live.next; link != &_live; link = link->next) {
+				f(*link);
+			}
+		}
+
+	private:
+		/// Room for the arena a frame belongs to.
+		static constexpr size_t HEADER = alignof(std::max_align_t);
+
+		static size_t _round(size_t size) {
+			return (size + HEADER - 1) / HEADER * HEADER;
+		}
+
+		Trampoline& _trampoline;
+		std::vector<std::unique_ptr<unsigned char[]>> _blocks;
+		size_t _used = 0;
+		size_t _capacity = 0;
+		/// Destroyed frames by size, linked through their first bytes.
+		std::unordered_map<size_t, void*> _free;
+		Link _live;
+		size_t _frames = 0;
+	};
+
+	/// Coroutine of the coroutine backend. Its parameters start with the CoroutineScheduler that runs it, the parser,
+	/// the layout, the position it starts at and the channel it passes positions to. Its frame comes from the
+	/// scheduler's FrameArena. It starts suspended, pass it to CoroutineScheduler::start().
+	struct ParseTask {
+		struct promise_type {
+			template<typename S, typename P, typename... Args>
+			promise_type(S& scheduler, const P&, std::string_view, size_t, ResultChannel& out, const Args&...)
+				: arena(scheduler.arena()) {
+				link.out = &out;
+			}
+
+			~promise_type() {
+				arena.unlink(link);
+			}
+
+			template<typename S, typename P, typename... Args>
+			static void* operator new(size_t size, S& scheduler, const P&, std::string_view, size_t position, ResultChannel&, const Args&...) {
+				return scheduler.arena().allocate(size, position);
+			}
+
+			static void operator delete(void* frame, size_t size) {
+				FrameArena::deallocate(frame, size);
+			}
+
+			ParseTask get_return_object() {
+				const auto handle = std::coroutine_handle<promise_type>::from_promise(*this);
+				link.handle = handle;
+				arena.link(link);
+				return { handle };
+			}
+
+			std::suspend_always initial_suspend() noexcept {
+				return {};
+			}
+
+			/// The scheduler destroys frames once they are done, see CoroutineScheduler::_resume().
+			std::suspend_always final_suspend() noexcept {
+				return {};
+			}
+
+			void return_void() {
+			}
+
+			void unhandled_exception() {
+				exception = std::current_exception();
+			}
+
+			FrameArena& arena;
+			FrameArena::Link link;
+			std::exception_ptr exception;
+		};
+
+		std::coroutine_handle<promise_type> handle;
+	};
+
+	struct CoroutineNode;
+
+	/// Positions a coroutine of the coroutine backend continues from. co_await returns the next one, and suspends
+	/// until there is one. Only the coroutine that owns a channel waits on it.
+	struct ResultChannel {
+		/// Failures go to forward, the channel of the coroutine this one continues.
+		explicit ResultChannel(ResultChannel* forward = nullptr)
+			: forward(forward) {
+		}
+
+		ResultChannel(const ResultChannel&) = delete;
+		ResultChannel& operator=(const ResultChannel&) = delete;
+
+		std::vector<size_t> positions;
+		size_t read = 0;
+		/// The frame that waits on the channel, and whether it does right now.
+		FrameArena::Link* owner = nullptr;
+		bool waiting = false;
+		/// Set for the channel of a GSS node, which passes what it gets on to the node's callers instead.
+		CoroutineNode* node = nullptr;
+		/// Unset for the channels of GSS nodes and the root, whose failures go to the parse.
+		ResultChannel* forward = nullptr;
+		/// Continuations the Trampoline holds that pass positions to the channel, see CoroutineScheduler::Pin.
+		size_t pins = 0;
+
+		bool await_ready() const noexcept {
+			return read < positions.size();
+		}
+
+		void await_suspend(std::coroutine_handle<ParseTask::promise_type> handle) noexcept {
+			owner = &handle.promise().link;
+			owner->in = this;
+			waiting = true;
+		}
+
+		size_t await_resume() noexcept {
+			const auto position = positions[read++];
+			if (read == positions.size()) {
+				positions.clear();
+				read = 0;
+			}
+			return position;
+		}
+	};
+
+	/// A rule called with one layout at one position.
+	struct CoroutineNode {
+		const void* rule = nullptr;
+		std::string_view layout;
+		size_t position = 0;
+		/// Each distinct position the rule reached.
+		ResultChannel channel;
+		std::unordered_set<size_t> distinct;
+		std::vector<ResultChannel*> callers;
+		/// Positions the body ran at again for calls in tail position.
+		std::unordered_set<size_t> tails;
+		/// Whether later calls get a node of their own, see CoroutineScheduler::_collect().
+		bool evicted = false;
+		uint64_t mark = 0;
+	};
+
+	/// Runs a parse on the coroutine backend, see ParseOptions::coroutines. A Sequence whose lhs calls rules is a
+	/// coroutine that waits on the channel of its lhs, a Repetition of rules one per element. Parsers that don't call
+	/// rules match with continuations like on the other backend, which pass what they reach on to a channel. Frames
+	/// start as descriptors of the parse's Trampoline and resume through Trampoline::resume(), so its schedule,
+	/// max_depth, budgets and stops apply, and so do tokens and partial input. Each time the frames and GSS nodes
+	/// doubled, the frames no channel can pass a position to any more are destroyed, and with Schedule::POSITION the
+	/// GSS nodes before the frontier nothing waits on.
+	class CoroutineScheduler {
+	public:
+		/// Frames and GSS nodes there have to be before the first collection.
+		static constexpr size_t MIN_COLLECT = 1024;
+
+		/// Run on trampoline, which has to be set up with options. What the grammar reaches goes to f. Throws
+		/// std::invalid_argument if options ask for more than one thread.
+		CoroutineScheduler(Trampoline& trampoline, const ParseOptions& options, Trampoline::Continuation f)
+			: _trampoline(trampoline)
+			, _f(std::move(f))
+			, _arena(trampoline) {
+			if (options.threads > 1)
+				throw std::invalid_argument("Gllpp: the coroutine backend runs on one thread");
+
+			_trampoline._reclaimed = [this]() {
+				_collect();
+			};
+		}
+
+		CoroutineScheduler(const CoroutineScheduler&) = delete;
+		CoroutineScheduler& operator=(const CoroutineScheduler&) = delete;
+
+		/// Continuations the Trampoline still holds point to channels in the frames.
+		~CoroutineScheduler() {
+			_trampoline._reclaimed = nullptr;
+			_trampoline.reset(std::string_view{});
+		}
+
+		/// Match parser from the start of the input.
+		template<typename P>
+		void enter(const P& parser) {
+			parser._spawn(*this, {}, 0, _root);
+		}
+
+		FrameArena& arena() {
+			return _arena;
+		}
+
+		std::string_view input(size_t position) const {
+			return _trampoline.input(position);
+		}
+
+		/// Run task as a descriptor at position.
+		void start(ParseTask task, size_t position) {
+			_trampoline.add(input(position), [this, link = &task.handle.promise().link](Trampoline&, std::string_view) {
+				_collect_if_due();
+				link->started = true;
+				_resume(*link);
+			});
+		}
+
+		/// Match parser, which doesn't call rules, with a continuation that passes what it reaches to out.
+		template<typename P>
+		void chain(const P& parser, std::string_view layout, size_t position, ResultChannel& out) {
+			parser._chain(_trampoline, layout, input(position), Sink{ Pin{ &out }, this });
+		}
+
+		/// Match lhs, which doesn't call rules, and rhs from each position it reaches, passing those of rhs to out.
+		template<typename LT, typename RT>
+		void then(const LT& lhs, const RT& rhs, std::string_view layout, size_t position, ResultChannel& out) {
+			lhs._chain(_trampoline, layout, input(position), Then<RT>{ Pin{ &out }, this, &rhs, layout });
+		}
+
+		/// Pass position to the coroutine waiting on out, or to the callers of its node.
+		void push(ResultChannel& out, size_t position) {
+			_pushes.emplace_back(&out, position);
+			while (!_pushes.empty()) {
+				const auto [channel, at] = _pushes.back();
+				_pushes.pop_back();
+
+				if (channel == &_root) {
+					_trampoline.resume(_f, ParserResult{ input(at) });
+				}
+				else if (channel->node != nullptr) {
+					if (!channel->node->distinct.insert(at).second)
+						continue;
+
+					const auto evicted = channel->node->evicted;
+					if (_trampoline._limited) {
+						if (_trampoline._results.fetch_add(1, std::memory_order_relaxed) >= _trampoline._maxResults)
+							throw BudgetExceeded(ParseStopped::Reason::RESULTS, at, _trampoline._maxResults);
+						_trampoline._charge(evicted ? Trampoline::POSITION_BYTES : Trampoline::POSITION_BYTES + Trampoline::RESULT_BYTES, at);
+					}
+
+					// Positions are only kept for calls that join the node later.
+					if (!evicted) {
+						channel->positions.push_back(at);
+					}
+					for (auto caller : channel->node->callers) {
+						_pushes.emplace_back(caller, at);
+					}
+				}
+				else {
+					channel->positions.push_back(at);
+					if (channel->waiting) {
+						channel->waiting = false;
+						_trampoline.resume(Wake{ Pin{ channel }, this }, ParserResult{ input(at) });
+					}
+				}
+			}
+		}
+
+		/// A parser that passes its positions to out failed at position. Like on the other backend, failures of rule
+		/// bodies go to the parse and the others to the results.
+		void fail(ResultChannel& out, size_t position, const std::string& error) {
+			auto channel = &out;
+			while (channel->forward != nullptr) {
+				channel = channel->forward;
+			}
+
+			if (channel == &_root) {
+				_trampoline.resume(_f, ParserResult{ input(position), error });
+			}
+			else {
+				_trampoline._fail(position, error);
+			}
+		}
+
+		/// Call rule with layout at position, its results go to out. A new GSS node runs body with its channel, an
+		/// existing one passes out the positions it already reached and the ones it reaches later.
+		template<typename F>
+		void call(const void* rule, std::string_view layout, size_t position, ResultChannel& out, F body) {
+			// Results of a call in tail position of the same rule go to the caller's node anyway, so the body runs
+			// again on that node instead of a new one, like Parser::_chain() does. Right recursion becomes a loop.
+			const auto caller = out.node;
+			if (caller != nullptr && caller->rule == rule && caller->layout.data() == layout.data() && caller->layout.size() == layout.size()) {
+				if (caller->tails.insert(position).second) {
+					_trampoline._charge(Trampoline::POSITION_BYTES, position);
+					body(out);
+				}
+				return;
+			}
+
+			const Key key{ rule, layout.data(), layout.size(), position };
+			if (auto it = _nodes.find(key); it != _nodes.end()) {
+				auto& node = it->second;
+				// Pushing may reach this node again and add to its positions.
+				for (size_t i = 0; i < node.channel.positions.size(); ++i) {
+					push(out, node.channel.positions[i]);
+				}
+				node.callers.push_back(&out);
+				return;
+			}
+
+			if (_trampoline._limited) {
+				if (_nodes.size() + _trampoline.gss_nodes() >= _trampoline._maxGssNodes)
+					throw BudgetExceeded(ParseStopped::Reason::GSS_NODES, position, _trampoline._maxGssNodes);
+				_trampoline._charge(NODE_BYTES, position);
+			}
+
+			auto& node = _nodes[key];
+			node.rule = rule;
+			node.layout = layout;
+			node.position = position;
+			node.channel.node = &node;
+			node.callers.push_back(&out);
+			body(node.channel);
+		}
+
+	private:
+		/// Keeps the frame that owns a channel while a continuation the Trampoline holds may pass positions to it.
+		class Pin {
+		public:
+			explicit Pin(ResultChannel* channel)
+				: _channel(channel) {
+				++_channel->pins;
+			}
+
+			Pin(const Pin& other)
+				: Pin(other._channel) {
+			}
+
+			Pin(Pin&& other) noexcept
+				: _channel(std::exchange(other._channel, nullptr)) {
+			}
+
+			Pin& operator=(Pin other) noexcept {
+				std::swap(_channel, other._channel);
+				return *this;
+			}
+
+			~Pin() {
+				if (_channel != nullptr) {
+					--_channel->pins;
+				}
+			}
+
+			ResultChannel& channel() const {
+				return *_channel;
+			}
+
+		private:
+			ResultChannel* _channel;
+		};
+
+		struct Sink {
+			void operator()(Trampoline& trampoline, ParserResult result) const {
+				const auto at = trampoline.position(result.trail);
+				if (result.is_success()) {
+					scheduler->push(out.channel(), at);
+				}
+				else {
+					scheduler->fail(out.channel(), at, *result.error);
+				}
+			}
+
+			Pin out;
+			CoroutineScheduler* scheduler;
+		};
+
+		template<typename RT>
+		struct Then {
+			void operator()(Trampoline& trampoline, ParserResult result) const {
+				const auto at = trampoline.position(result.trail);
+				if (result.is_success()) {
+					rhs->_spawn(*scheduler, layout, at, out.channel());
+				}
+				else {
+					scheduler->fail(out.channel(), at, *result.error);
+				}
+			}
+
+			Pin out;
+			CoroutineScheduler* scheduler;
+			const RT* rhs;
+			std::string_view layout;
+		};
+
+		/// Resumes the frame waiting on a channel.
+		struct Wake {
+			void operator()(Trampoline&, const ParserResult&) const {
+				scheduler->_resume(*channel.channel().owner);
+			}
+
+			Pin channel;
+			CoroutineScheduler* scheduler;
+		};
+
+		struct Key {
+			const void* rule;
+			const char* layout;
+			size_t layoutSize;
+			size_t position;
+
+			bool operator==(const Key& other) const {
+				return rule == other.rule && layout == other.layout && layoutSize == other.layoutSize && position == other.position;
+			}
+		};
+
+		struct KeyHash {
+			size_t operator()(const Key& key) const {
+				return std::hash<const void*>{}(key.rule) ^ std::hash<const void*>{}(key.layout) ^ (key.position * 0x9E3779B97F4A7C15ull);
+			}
+		};
+
+		/// Estimated bytes of a GSS node, see ParseOptions::max_memory.
+		static constexpr size_t NODE_BYTES = sizeof(CoroutineNode) + sizeof(Key) + 4 * sizeof(void*);
+
+		void _resume(FrameArena::Link& link) {
+			const auto handle = std::coroutine_handle<ParseTask::promise_type>::from_address(link.handle.address());
+			handle.resume();
+			if (!handle.done())
+				return;
+
+			// A frame that threw stays until it's collected or the parse is dropped, channels may still point into it.
+			if (const auto exception = handle.promise().exception)
+				std::rethrow_exception(exception);
+			handle.destroy();
+		}
+
+		/// Only runs between descriptors, when no frame is running.
+		void _collect_if_due() {
+			if (_arena.frames() + _nodes.size() + _evicted.size() < _collectAt)
+				return;
+
+			_collect();
+			_collectAt = std::max(MIN_COLLECT, 2 * (_arena.frames() + _nodes.size() + _evicted.size()));
+		}
+
+		/// Marks what may still get positions, starting from the frames that haven't started and the channels the
+		/// Trampoline holds continuations for. A frame passes its positions to its out channel, a GSS node to its
+		/// callers' channels, and a channel to the frame that waits on it. What isn't marked is dropped, GSS nodes
+		/// once they're before the frontier. Those are evicted like Trampoline::_reclaim() does: later calls get new
+		/// nodes, so they only keep what they need to pass on positions once.
+		void _collect() {
+			++_epoch;
+			const auto reach = [this](FrameArena::Link& link) {
+				if (link.mark != _epoch) {
+					link.mark = _epoch;
+					_marking.push_back(link.out);
+				}
+			};
+			const auto pinned = [this](CoroutineNode& node) {
+				if (node.channel.pins > 0) {
+					_marking.push_back(&node.channel);
+				}
+			};
+
+			_arena.each([&](FrameArena::Link& link) {
+				if (!link.started || (link.in != nullptr && link.in->pins > 0)) {
+					reach(link);
+				}
+			});
+			for (auto& [key, node] : _nodes) {
+				pinned(node);
+			}
+			for (auto& evicted : _evicted) {
+				pinned(evicted.mapped());
+			}
+
+			while (!_marking.empty()) {
+				const auto channel = _marking.back();
+				_marking.pop_back();
+				if (channel->node != nullptr) {
+					if (channel->node->mark == _epoch)
+						continue;
+
+					channel->node->mark = _epoch;
+					for (auto caller : channel->node->callers) {
+						_marking.push_back(caller);
+					}
+				}
+				else if (channel->owner != nullptr) {
+					reach(*channel->owner);
+				}
+			}
+
+			const auto frontier = _trampoline.frontier();
+			const auto dropped = [&](const CoroutineNode& node) {
+				return node.mark != _epoch && node.position < frontier;
+			};
+			const auto sweep = [&](CoroutineNode& node) {
+				node.callers.erase(std::remove_if(node.callers.begin(), node.callers.end(), [&](ResultChannel* caller) {
+					if (caller->node != nullptr)
+						return dropped(*caller->node);
+					return caller->owner != nullptr && caller->owner->mark != _epoch;
+				}), node.callers.end());
+			};
+			for (auto& [key, node] : _nodes) {
+				sweep(node);
+			}
+			for (auto& evicted : _evicted) {
+				sweep(evicted.mapped());
+			}
+
+			for (auto it = _nodes.begin(); it != _nodes.end();) {
+				if (it->second.position < frontier) {
+					_evicted.push_back(_nodes.extract(it++));
+				}
+				else {
+					++it;
+				}
+			}
+			for (size_t i = 0; i < _evicted.size();) {
+				auto& node = _evicted[i].mapped();
+				if (dropped(node)) {
+					_trampoline._refund(_footprint(node));
+					_evicted[i] = std::move(_evicted.back());
+					_evicted.pop_back();
+					continue;
+				}
+
+				if (!node.evicted) {
+					node.evicted = true;
+					_trampoline._refund(node.channel.positions.size() * Trampoline::RESULT_BYTES);
+					node.channel.positions = {};
+				}
+				const auto positions = node.distinct.size() + node.tails.size();
+				Trampoline::_erase_before(node.distinct, frontier);
+				Trampoline::_erase_before(node.tails, frontier);
+				_trampoline._refund((positions - node.distinct.size() - node.tails.size()) * Trampoline::POSITION_BYTES);
+				++i;
+			}
+
+			std::vector<std::coroutine_handle<>> unreachable;
+			_arena.each([&](FrameArena::Link& link) {
+				if (link.mark != _epoch) {
+					unreachable.push_back(link.handle);
+				}
+			});
+			for (auto handle : unreachable) {
+				handle.destroy();
+			}
+		}
+
+		static size_t _footprint(const CoroutineNode& node) {
+			return NODE_BYTES + (node.distinct.size() + node.tails.size()) * Trampoline::POSITION_BYTES + node.channel.positions.size() * Trampoline::RESULT_BYTES;
+		}
+
+		Trampoline& _trampoline;
+		Trampoline::Continuation _f;
+		/// Channel of the grammar, it passes what it gets on to _f.
+		ResultChannel _root;
+		std::unordered_map<Key, CoroutineNode, KeyHash> _nodes;
+		/// Nodes before the frontier that may still pass on positions, see _collect().
+		std::vector<std::unordered_map<Key, CoroutineNode, KeyHash>::node_type> _evicted;
+		std::vector<std::pair<ResultChannel*, size_t>> _pushes;
+		std::vector<ResultChannel*> _marking;
+		uint64_t _epoch = 0;
+		size_t _collectAt = MIN_COLLECT;
+		/// Last, so the frames go first.
+		FrameArena _arena;
+	};
+
+#else
+	/// Stands in for the coroutine backend where C++20 coroutines aren't available.
+	class CoroutineScheduler {
+	public:
+		CoroutineScheduler(Trampoline&, const ParseOptions&, Trampoline::Continuation) {
+			throw std::logic_error("Gllpp: the coroutine backend needs C++20 coroutines");
+		}
+
+		template<typename P>
+		void enter(const P&) {
+		}
+	};
+#endif
+
+
+
+
+	/// State that parses run one after another can share, so small documents don't pay for setting up the GSS, the
+	/// queues and the tables again each time. Keep one per thread and pass it to ComposableParser::parse(). The
+	/// containers keep their capacity, and clearing the tables takes time proportional to what the last parse used.
+	class ParseContext {
+	public:
+		explicit ParseContext(const ParseOptions& options = {})
+			: _trampoline(std::string_view{}, options)
+			, _options(options) {
+		}
+
+		ParseContext(const ParseContext&) = delete;
+		ParseContext& operator=(const ParseContext&) = delete;
+
+		/// Whether the last parse settled for the first parse, see ParseOptions::degrade_after.
+		bool degraded() const {
+			return _trampoline.degraded();
+		}
+
+		/// Times the beam of the last parse turned a GSS node away or pruned one, see ParseOptions::beam_width.
+		size_t pruned() const {
+			return _trampoline.pruned();
+		}
+
+		/// Most bytes the last parse held at once, see Trampoline::peak_memory().
+		size_t peak_memory() const {
+			return _trampoline.peak_memory();
+		}
+
+	private:
+		template<typename T>
+		friend class ComposableParser;
+
+		Trampoline _trampoline;
+		ResultCollector _collector;
+		std::vector<ParserResult> _results;
+		ParseOptions _options;
+		/// After _trampoline, which it drops the continuations of.
+		std::optional<CoroutineScheduler> _scheduler;
+	};
+
+	class ParserBase {
+	};
+
+	template<typename T>
+	class ComposableParser : public ParserBase {
+	public:
+		/// Match the tokens with contained grammar, which has to be made of TokenParsers. Trails of the results point into the source.
+		std::vector<ParserResult> parse(const TokenStream& tokens, const ParseOptions& options = {}) const {
+			if (tokens.error)
+				return { ParserResult{ tokens.source.substr(*tokens.error), "Unknown token" } };
+
+			Trampoline trampoline{ tokens.kinds, options, &tokens };
+			auto results = _run(trampoline, tokens.kinds, options);
+			for (auto& result : results) {
+				result.trail = tokens.source_trail(result.trail);
+			}
+			return results;
+		}
+
+		/// Match str with contained grammar. Return either a list of successes or failures.
+		std::vector<ParserResult> parse(std::string_view str, const ParseOptions& options = {}) const {
+			Trampoline trampoline{ str, options };
+			return _run(trampoline, str, options);
+		}
+
+		/// Match str reusing the state of earlier parses in context. Returns results that stay valid until the next
+		/// parse with context.
+		const std::vector<ParserResult>& parse(std::string_view str, ParseContext& context) const {
+			auto& trampoline = context._trampoline;
+			context._scheduler.reset();
+			trampoline.reset(str);
+			context._collector.reset();
+			_begin(trampoline, str, context._options, context._scheduler, [&context](Trampoline& trampoline, ParserResult result) {
+				context._collector.add(trampoline, result);
+			});
+			trampoline.run();
+
+			context._collector.results(trampoline, context._results);
+			return context._results;
+		}
+
+		/// Match the concatenation of segments without copying them. Trails only reach to the end of the segment they
+		/// start in, and are empty at the end of the input.
+		std::vector<ParserResult> parse(const std::vector<std::string_view>& segments, const ParseOptions& options = {}) const {
+			Trampoline trampoline{ segments, options };
+			return _run(trampoline, trampoline.input(0), options);
+		}
+
+		/// Match str on a thread of WorkerPool::shared(), so at most one parse per core runs and further ones queue.
+		/// The grammar is shared with the parse, not copied: it and str have to outlive the future, and the grammar
+		/// must not be reassigned or compiled until it's ready. Don't wait for the future on a thread of the pool.
+		/// Give it a ParseOptions::cancellation to stop it early. The future rethrows what the parse throws, e.g.
+		/// ParseStopped.
+		std::future<std::vector<ParserResult>> parse_async(std::string_view str, const ParseOptions& options = {}) const& {
+			const auto task = std::make_shared<std::packaged_task<std::vector<ParserResult>()>>([this, str, options]() {
+				return parse(str, options);
+			});
+			auto future = task->get_future();
+			WorkerPool::shared().post([task]() {
+				(*task)();
+			});
+			return future;
+		}
+
+		/// A temporary grammar would be gone before the parse.
+		std::future<std::vector<ParserResult>> parse_async(std::string_view str, const ParseOptions& options = {}) const&& = delete;
+
+		/// Match the contents of the file at path without copying them. Throws std::system_error if it can't be read.
+		FileParse parse_file(const std::string& path, const ParseOptions& options = {}) const {
+			FileParse parse{ MappedFile{ path }, {} };
+			parse.results = this->parse(parse.file.view(), options);
+			return parse;
+		}
+
+		/// Match each of documents on its own, spread over threads workers (0 for one per core) that steal from each
+		/// other. Each worker reuses one ParseContext for all of its documents. Returns the results of documents[i] at
+		/// index i. The grammar is only read while parsing, it must not be reassigned or compiled until this returns.
+		/// The first exception a parse throws is rethrown once all workers stopped.
+		std::vector<std::vector<ParserResult>> parse_batch(const std::vector<std::string_view>& documents, const ParseOptions& options = {}, size_t threads = 0) const {
+			if (threads == 0) {
+				threads = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+			}
+			threads = std::max<size_t>(std::min(threads, documents.size()), 1);
+
+			std::vector<std::vector<ParserResult>> results(documents.size());
+			StealingRanges ranges{ documents.size(), threads };
+			std::atomic<bool> failed{ false };
+			std::exception_ptr error;
+			std::mutex errorMutex;
+
+			const auto work = [&](size_t worker) {
+				try {
+					ParseContext context{ options };
+					while (!failed.load(std::memory_order_relaxed)) {
+						const auto index = ranges.take(worker);
+						if (!index)
+							break;
+
+						results[*index] = parse(documents[*index], context);
+					}
+				}
+				catch (...) {
+					std::lock_guard<std::mutex> lock{ errorMutex };
+					if (!error) {
+						error = std::current_exception();
+					}
+					failed = true;
+				}
+			};
+
+			std::vector<std::thread> workers;
+			const auto join = [&workers]() {
+				for (auto& worker : workers) {
+					worker.join();
+				}
+			};
+
+			try {
+				for (size_t i = 1; i < threads; ++i) {
+					workers.emplace_back(work, i);
+				}
+			}
+			catch (...) {
+				failed = true;
+				join();
+				throw;
+			}
+			work(0);
+			join();
+
+			if (error) {
+				std::rethrow_exception(error);
+			}
+			return results;
+		}
+
+		/// Match each line read from descriptor on its own, e.g. the records of a log. One thread reads blocks of lines
+		/// and queues them, threads workers (0 for one per core) parse them, and consumer is called on this thread with
+		/// (line number, line, results) in the order of the input. Lines don't include their '\n' or a '\r' before
+		/// it, trails point into the line and are only valid during the call. At most window blocks are read ahead of
+		/// the consumer, so a slow consumer slows down reading instead of buffering the whole input. Returns the number
+		/// of lines. The first exception the read, a parse or consumer throws is rethrown once all threads stopped.
+		template<typename F>
+		size_t parse_lines(int descriptor, F consumer, const ParseOptions& options = {}, size_t threads = 0, size_t window = 64) const {
+			if (threads == 0) {
+				threads = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+			}
+			window = std::max<size_t>(window, 1);
+
+			constexpr size_t BLOCK_SIZE = 64 * 1024;
+			constexpr auto END = std::numeric_limits<size_t>::max();
+
+			// A block of whole lines, reused once its lines were consumed.
+			struct Block {
+				std::string buffer;
+				size_t first = 0;
+				std::vector<std::string_view> lines;
+				std::vector<std::vector<ParserResult>> results;
+				std::atomic<bool> parsed{ false };
+			};
+
+			std::unique_ptr<Block[]> blocks{ new Block[window] };
+			BoundedQueue queue{ window + threads };
+			std::atomic<size_t> consumed{ 0 };
+			std::atomic<size_t> total{ END };
+			std::atomic<bool> failed{ false };
+			std::exception_ptr error;
+			std::mutex errorMutex;
+
+			const auto fail = [&]() {
+				std::lock_guard<std::mutex> lock{ errorMutex };
+				if (!error) {
+					error = std::current_exception();
+				}
+				failed = true;
+			};
+
+			// Yield while spinning, then sleep briefly so threads waiting for a slow input or consumer don't burn cores.
+			const auto wait = [](size_t& spins) {
+				if (++spins < 64) {
+					std::this_thread::yield();
+				}
+				else {
+					std::this_thread::sleep_for(std::chrono::microseconds(50));
+				}
+			};
+
+			const auto read = [&]() {
+				try {
+					std::string rest;
+					size_t serial = 0;
+					size_t line = 0;
+					bool end = false;
+					while (!end) {
+						size_t spins = 0;
+						while (serial - consumed.load(std::memory_order_acquire) >= window) {
+							if (failed.load(std::memory_order_relaxed))
+								return;
+							wait(spins);
+						}
+
+						auto& block = blocks[serial % window];
+						block.buffer.swap(rest);
+						rest.clear();
+
+						// Read until the block ends in at least one whole line. What was left over has no '\n'.
+						size_t last = std::string::npos;
+						while (last == std::string::npos) {
+							const auto size = block.buffer.size();
+							block.buffer.resize(size + BLOCK_SIZE);
+							const auto numRead = read_some(descriptor, &block.buffer[size], BLOCK_SIZE);
+							block.buffer.resize(size + numRead);
+							if (numRead == 0) {
+								end = true;
+								break;
+							}
+
+							const auto found = std::string_view{ block.buffer }.substr(size).rfind('\n');
+							if (found != std::string_view::npos) {
+								last = size + found;
+							}
+						}
+
+						if (!end) {
+							rest.assign(block.buffer, last + 1);
+							block.buffer.resize(last + 1);
+						}
+
+						const std::string_view data = block.buffer;
+						block.first = line;
+						for (size_t begin = 0; begin < data.size();) {
+							auto newline = data.find('\n', begin);
+							if (newline == std::string_view::npos) {
+								newline = data.size();
+							}
+
+							auto text = data.substr(begin, newline - begin);
+							if (!text.empty() && text.back() == '\r') {
+								text.remove_suffix(1);
+							}
+							block.lines.push_back(text);
+							begin = newline + 1;
+						}
+						line += block.lines.size();
+
+						if (block.lines.empty() && end)
+							break;
+
+						while (!queue.push(serial)) {
+							std::this_thread::yield();
+						}
+						++serial;
+					}
+
+					total = serial;
+				}
+				catch (...) {
+					fail();
+				}
+
+				// Each parser stops once it took an END.
+				for (size_t i = 0; i < threads; ++i) {
+					while (!queue.push(END)) {
+						std::this_thread::yield();
+					}
+				}
+			};
+
+			const auto work = [&]() {
+				try {
+					ParseContext context{ options };
+					for (;;) {
+						size_t spins = 0;
+						std::optional<size_t> serial;
+						while (!(serial = queue.pop())) {
+							if (failed.load(std::memory_order_relaxed))
+								return;
+							wait(spins);
+						}
+
+						if (*serial == END)
+							return;
+
+						auto& block = blocks[*serial % window];
+						block.results.resize(block.lines.size());
+						for (size_t i = 0; i < block.lines.size(); ++i) {
+							block.results[i] = parse(block.lines[i], context);
+						}
+						block.parsed.store(true, std::memory_order_release);
+					}
+				}
+				catch (...) {
+					fail();
+				}
+			};
+
+			std::vector<std::thread> workers;
+			const auto join = [&workers]() {
+				for (auto& worker : workers) {
+					worker.join();
+				}
+			};
+
+			try {
+				workers.emplace_back(read);
+				for (size_t i = 0; i < threads; ++i) {
+					workers.emplace_back(work);
+				}
+			}
+			catch (...) {
+				failed = true;
+				join();
+				throw;
+			}
+
+			size_t lines = 0;
+			try {
+				for (size_t serial = 0;; ++serial) {
+					auto& block = blocks[serial % window];
+					size_t spins = 0;
+					while (!block.parsed.load(std::memory_order_acquire)) {
+						if (failed.load(std::memory_order_relaxed) || serial == total.load(std::memory_order_acquire))
+							break;
+						wait(spins);
+					}
+
+					if (!block.parsed.load(std::memory_order_acquire))
+						break;
+
+					for (size_t i = 0; i < block.lines.size(); ++i) {
+						consumer(block.first + i, block.lines[i], block.results[i]);
+					}
+					lines = block.first + block.lines.size();
+
+					block.lines.clear();
+					block.results.clear();
+					block.parsed.store(false, std::memory_order_relaxed);
+					consumed.store(serial + 1, std::memory_order_release);
+				}
+			}
+			catch (...) {
+				fail();
+			}
+			join();
+
+			if (error) {
+				std::rethrow_exception(error);
+			}
+			return lines;
+		}
+
+		std::vector<ParserResult> _run(Trampoline& trampoline, std::string_view str, const ParseOptions& options) const {
+			ResultCollector collector;
+			std::optional<CoroutineScheduler> scheduler;
+			_begin(trampoline, str, options, scheduler, [&collector](Trampoline& trampoline, ParserResult result) {
+				collector.add(trampoline, result);
+			});
+			trampoline.run();
+
+			return collector.results(trampoline);
+		}
+
+		/// Match from str, the start of trampoline's input, passing what the grammar reaches to f. With
+		/// ParseOptions::coroutines that's on the coroutine backend, which scheduler then runs.
+		template<typename F>
+		void _begin(Trampoline& trampoline, std::string_view str, const ParseOptions& options, std::optional<CoroutineScheduler>& scheduler, F f) const {
+			if (options.coroutines) {
+				scheduler.emplace(trampoline, options, f);
+				scheduler->enter(*static_cast<const T*>(this));
+				return;
+			}
+
+			static_cast<const T*>(this)->_chain(trampoline, {}, str, f);
+		}
+
+		template<typename F>
+		void _gather(F f) const {
+			f(*static_cast<const T*>(this));
+		}
+
+		/// Parsers that don't override this aren't regular.
+		std::optional<RegularBuilder::Fragment> _build(RegularBuilder& builder, std::string_view layout) const {
+			return std::nullopt;
+		}
+
+#if __cpp_impl_coroutine
+		/// Whether the parser calls rules. Parsers that don't match with their continuations on the coroutine backend
+		/// too, see CoroutineScheduler::chain().
+		static constexpr bool _calls_rules = false;
+
+		/// Match at position on the coroutine backend, passing the positions reached to out.
+		void _spawn(CoroutineScheduler& scheduler, std::string_view layout, size_t position, ResultChannel& out) const {
+			scheduler.chain(*static_cast<const T*>(this), layout, position, out);
+		}
+#endif
+
+		template<typename W>
+		void _walk(W& walker, std::string_view layout) const {
+		}
+
+		/// Add the tokens the parser can start with to first. Returns whether it can match the empty string.
+		bool _first(TokenAnalysis& analysis, TokenSet& first) const {
+			return true;
+		}
+
+		/// Weight of the rule the parser starts with, see Schedule::BEST_FIRST.
+		int _weight() const {
+			return 0;
+		}
+
+		/// expected are the tokens valid where the parser starts, follow the ones valid after it.
+		void _expect(TokenAnalysis& analysis, TokenSet expected, TokenSet follow) const {
+		}
+
+		template<typename OtherT>
+		Sequence<T, OtherT> operator+(OtherT other) const {
+			return { *static_cast<const T*>(this), other };
+		}
+
+		template<typename OtherT>
+		Disjunction<T, OtherT> operator|(OtherT other) const {
+			return { *static_cast<const T*>(this), other };
+		}
+
+	protected:
+		/// Run the parser again at str once more input arrived, if more may arrive. Returns whether it did suspend.
+		template<typename F>
+		bool _suspend(Trampoline& trampoline, std::string_view layout, std::string_view str, F f) const {
+			if (!trampoline.partial())
+				return false;
+
+			trampoline.suspend(str, [self = static_cast<const T*>(this), layout, f](Trampoline& trampoline, std::string_view str) {
+				self->_chain(trampoline, layout, str, f);
+			});
+			return true;
+		}
+	};
+
+	class Parser : public ComposableParser<Parser> {
+	public:
+		Parser()
+			: _wrapper(std::make_shared<SharedWrapper>()) {
+		}
+
+		template<typename P>
+		Parser(P p)
+			: Parser() {
+			*this = p;
+		}
+
+		template<typename P>
+		Parser& operator=(P p) {
+			static_assert(std::is_base_of_v<ParserBase, P>);
+			_wrapper->wrapper = std::make_unique<WrapperInstance<P>>(p);
+			_wrapper->regular.clear();
+			return *this;
+		}
+
+		/// Name used in reports and error messages.
+		const std::string& name() const {
+			return _wrapper->name;
+		}
+
+		void set_name(std::string name) {
+			_wrapper->name = name;
+		}
+
+		/// Alternatives starting with rules of higher weight are tried first, see Schedule::BEST_FIRST.
+		int weight() const {
+			return _wrapper->weight;
+		}
+
+		void set_weight(int weight) {
+			_wrapper->weight = weight;
+		}
+
+		/// Where a call of this rule may begin: wherever sync, which has to be regular, matches. parse_definitions()
+		/// splits its input there. Throws std::invalid_argument if sync isn't regular or matches empty input.
+		template<typename P>
+		void set_sync(P sync) {
+			static_assert(std::is_base_of_v<ParserBase, P>);
+			RegularBuilder builder;
+			const auto fragment = sync._build(builder, {});
+			if (!fragment)
+				throw std::invalid_argument("Gllpp::Parser::set_sync() needs a regular rule");
+
+			builder.nfa.set_accept(fragment->end, 0);
+			auto dfa = Dfa::build(builder.nfa, fragment->start);
+			if (!dfa || dfa->longest({}).second >= 0)
+				throw std::invalid_argument("Gllpp::Parser::set_sync() needs a regular rule that doesn't match empty input");
+
+			_wrapper->sync = std::make_shared<const Dfa>(std::move(*dfa));
+		}
+
+		/// The DFA set with set_sync(), or nullptr.
+		const Dfa* sync() const {
+			return _wrapper->sync.get();
+		}
+
+		template<typename F>
+		void _chain(Trampoline& trampoline, std::string_view layout, std::string_view str, F f) const {
+			if (_wrapper->wrapper == nullptr) {
+				trampoline.resume(f, ParserResult{ str, "Parser is null" });
+				return;
+			}
+
+			if (auto dfa = _wrapper->find_regular(layout)) {
+				_match_regular(trampoline, *dfa, str, f, {}, false);
+				return;
+			}
+
+			if constexpr (std::is_same_v<F, Trampoline::Continuation>) {
+				// Results of a call in tail position of the same rule go to the caller's node anyway, so the body
+				// runs again on that node instead of pushing a new one. Right recursion becomes a loop. Recording
+				// parses keep a call per position instead, so the rest of a list is a memo of its own.
+				const auto ret = f.template target<Trampoline::Return>();
+				if (ret != nullptr && !trampoline.recording() && ret->node->rule == _id() && ret->node->layout.data() == layout.data() && ret->node->layout.size() == layout.size()) {
+					if (trampoline.enter_tail(*ret->node, str)) {
+						_wrapper->wrapper->chain(trampoline, layout, str, f);
+					}
+					return;
+				}
+			}
+
+			if (auto node = trampoline.call(_id(), layout, str, f, _wrapper->weight)) {
+				const auto caller = trampoline.enter(node);
+				_wrapper->wrapper->chain(trampoline, layout, str, Trampoline::Return{ node });
+				trampoline.leave(caller);
+			}
+		}
+
+		std::optional<RegularBuilder::Fragment> _build(RegularBuilder& builder, std::string_view layout) const {
+			if (_wrapper->wrapper == nullptr)
+				return std::nullopt;
+
+			return builder.rule(_wrapper.get(), layout, [&]() {
+				return _wrapper->wrapper->build(builder, layout);
+			});
+		}
+
+#if __cpp_impl_coroutine
+		static constexpr bool _calls_rules = true;
+
+		void _spawn(CoroutineScheduler& scheduler, std::string_view layout, size_t position, ResultChannel& out) const {
+			// Null and compiled rules don't call any.
+			if (_wrapper->wrapper == nullptr || _wrapper->find_regular(layout)) {
+				scheduler.chain(*this, layout, position, out);
+				return;
+			}
+
+			scheduler.call(_id(), layout, position, out, [&](ResultChannel& node) {
+				_wrapper->wrapper->spawn(scheduler, layout, position, node);
+			});
+		}
+#endif
+
+		template<typename W>
+		void _walk(W& walker, std::string_view layout) const {
+			walker.visit(*this, layout);
+		}
+
+		void _walk_body(RuleWalker& walker, std::string_view layout) const {
+			if (_wrapper->wrapper != nullptr) {
+				_wrapper->wrapper->walk(walker, layout);
+			}
+		}
+
+		bool _first(TokenAnalysis& analysis, TokenSet& first) const {
+			return analysis.first(_id(), first);
+		}
+
+		bool _first_body(TokenAnalysis& analysis, TokenSet& first) const {
+			return _wrapper->wrapper != nullptr && _wrapper->wrapper->first(analysis, first);
+		}
+
+		int _weight() const {
+			return _wrapper->weight;
+		}
+
+		void _expect(TokenAnalysis& analysis, TokenSet expected, TokenSet follow) const {
+			analysis.call(_id(), expected, follow);
+		}
+
+		void _expect_body(TokenAnalysis& analysis, TokenSet expected, TokenSet follow) const {
+			if (_wrapper->wrapper != nullptr) {
+				_wrapper->wrapper->expect(analysis, expected, follow);
+			}
+		}
+
+		const void* _id() const {
+			return _wrapper.get();
+		}
+
+		/// Run dfa on str from the given point. If it reaches the end of partial input, it continues from there
+		/// once more input arrived.
+		template<typename F>
+		void _match_regular(Trampoline& trampoline, const Dfa& dfa, std::string_view str, F f, Dfa::Suspension from, bool matched) const {
+			const auto suspension = trampoline.match(dfa, trampoline.position(str), [&](size_t length, int32_t) {
+				matched = true;
+				trampoline.resume(f, ParserResult{ trampoline.advance(str, length) });
+			}, from);
+
+			if (suspension) {
+				trampoline.suspend(str, [self = *this, &dfa, f, from = *suspension, matched](Trampoline& trampoline, std::string_view str) {
+					self._match_regular(trampoline, dfa, str, f, from, matched);
+				});
+				return;
+			}
+
+			if (!matched) {
+				trampoline.resume(f, ParserResult{ str, "Rule " + _wrapper->name + " not matched" });
+			}
+		}
+
+		/// Match the rule with dfa instead of its body whenever it is used with this layout.
+		void _set_regular(std::string_view layout, std::shared_ptr<const Dfa> dfa) const {
+			for (auto& regular : _wrapper->regular) {
+				if (regular.first == layout) {
+					regular.second = dfa;
+					return;
+				}
+			}
+
+			_wrapper->regular.emplace_back(layout, dfa);
+		}
+
+	private:
+		class IWrapper {
+		public:
+			virtual ~IWrapper() = default;
+
+			virtual void chain(Trampoline& trampoline, const std::string_view layout, std::string_view str, Trampoline::Continuation f) const = 0;
+			virtual std::optional<RegularBuilder::Fragment> build(RegularBuilder& builder, std::string_view layout) const = 0;
+			virtual void walk(RuleWalker& walker, std::string_view layout) const = 0;
+			virtual bool first(TokenAnalysis& analysis, TokenSet& first) const = 0;
+			virtual void expect(TokenAnalysis& analysis, TokenSet expected, TokenSet follow) const = 0;
+#if __cpp_impl_coroutine
+			virtual void spawn(CoroutineScheduler& scheduler, std::string_view layout, size_t position, ResultChannel& out) const = 0;
+#endif
+		};
+
+		template<typename P>
+		class WrapperInstance final : public IWrapper {
+		public:
+			WrapperInstance(P p)
+				: _parser(p) {
+			}
+
+			virtual void chain(Trampoline& trampoline, std::string_view layout, std::string_view str, Trampoline::Continuation f) const override {
+				_parser._chain(trampoline, layout, str, f);
+			}
+
+			virtual std::optional<RegularBuilder::Fragment> build(RegularBuilder& builder, std::string_view layout) const override {
+				return _parser._build(builder, layout);
+			}
+
+			virtual void walk(RuleWalker& walker, std::string_view layout) const override {
+				_parser._walk(walker, layout);
+			}
+
+			virtual bool first(TokenAnalysis& analysis, TokenSet& first) const override {
+				return _parser._first(analysis, first);
+			}
+
+			virtual void expect(TokenAnalysis& analysis, TokenSet expected, TokenSet follow) const override {
+				_parser._expect(analysis, expected, follow);
+			}
+
+#if __cpp_impl_coroutine
+			virtual void spawn(CoroutineScheduler& scheduler, std::string_view layout, size_t position, ResultChannel& out) const override {
+				_parser._spawn(scheduler, layout, position, out);
+			}
+#endif
+
+		private:
+			P _parser;
+		};
+
+		struct SharedWrapper {
+			std::unique_ptr<IWrapper> wrapper;
+			std::string name;
+			int weight = 0;
+			std::vector<std::pair<std::string, std::shared_ptr<const Dfa>>> regular;
+			std::shared_ptr<const Dfa> sync;
+
+			const Dfa* find_regular(std::string_view layout) const {
+				for (auto& entry : regular) {
+					if (entry.first == layout)
+						return entry.second.get();
+				}
+				return nullptr;
+			}
+		};
+
+		std::shared_ptr<SharedWrapper> _wrapper;
+	};
+
+
+	template<typename P>
+	class Layout : public ComposableParser<Layout<P>> {
+	public:
+		Layout(P p, std::string layout)
+			: _p(p)
+			, _layout(layout) {
+			static_assert(std::is_base_of_v<ParserBase, P>);
+		}
+
+		template<typename F>
+		void _chain(Trampoline& trampoline, const std::string_view layout, std::string_view str, F f) const {
+			(void)layout;
+			_p._chain(trampoline, _layout, str, f);
+		}
+
+		std::optional<RegularBuilder::Fragment> _build(RegularBuilder& builder, std::string_view layout) const {
+			return _p._build(builder, _layout);
+		}
+
+#if __cpp_impl_coroutine
+		static constexpr bool _calls_rules = P::_calls_rules;
+
+		void _spawn(CoroutineScheduler& scheduler, std::string_view layout, size_t position, ResultChannel& out) const {
+			_p._spawn(scheduler, _layout, position, out);
+		}
+#endif
+
+		template<typename W>
+		void _walk(W& walker, std::string_view layout) const {
+			_p._walk(walker, _layout);
+		}
+
+		bool _first(TokenAnalysis& analysis, TokenSet& first) const {
+			return _p._first(analysis, first);
+		}
+
+		void _expect(TokenAnalysis& analysis, TokenSet expected, TokenSet follow) const {
+			_p._expect(analysis, expected, follow);
+		}
+
+	private:
+		P _p;
+		std::string _layout;
+	};
+
+
+	/// Set layout for all parsers inside the passed Parser p. Layout is a list of chars which are automatically removed after every Parser.
+	template<typename P>
+	Layout<P> layout(P p, std::string definition) {
+		static_assert(std::is_base_of_v<ParserBase, P>);
+		return { p, definition };
+	}
+
+
+
+	class Empty : public ComposableParser<Empty> {
+	public:
+		template<typename F>
+		void _chain(Trampoline& trampoline, const std::string_view layout, std::string_view str, F f) const {
+			trampoline.resume(f, ParserResult{ str });
+		}
+
+		std::optional<RegularBuilder::Fragment> _build(RegularBuilder& builder, std::string_view layout) const {
+			return builder.empty();
+		}
+
+#if __cpp_impl_coroutine
+		void _spawn(CoroutineScheduler& scheduler, std::string_view layout, size_t position, ResultChannel& out) const {
+			scheduler.push(out, position);
+		}
+#endif
+	};
+
+
+
+
+	namespace {
+		template<char DELIMITER, char... TRAIL>
+		struct CaptureDelimiterUtil {
+			static bool equals(char c) {
+				if (c == DELIMITER)
+					return true;
+
+				return CaptureDelimiterUtil<TRAIL...>::equals(c);
+			}
+		};
+
+		template<char DELIMITER>
+		struct CaptureDelimiterUtil<DELIMITER> {
+			static bool equals(char c) {
+				return c == DELIMITER;
+			}
+		};
+	}
+
+	template<char... DELIMITERS>
+	class Capture : public ComposableParser<Capture<DELIMITERS...>> {
+	public:
+		template<typename F>
+		void _chain(Trampoline& trampoline, const std::string_view layout, std::string_view str, F f) const {
+			Cursor cursor{ trampoline, str };
+			cursor.skip_while([](char c) {
+				return !CaptureDelimiterUtil<DELIMITERS...>::equals(c);
+			});
+
+			if (cursor.at_end() && this->_suspend(trampoline, layout, str, f))
+				return;
+
+			if (cursor.trail().data() == str.data()) {
+				trampoline.resume(f, ParserResult{ str, "Capture empty value" });
+			}
+
+			cursor.skip(layout);
+			if (cursor.at_end() && !layout.empty() && this->_suspend(trampoline, layout, str, f))
+				return;
+
+			trampoline.resume(f, ParserResult{ cursor.trail() });
+			return;
+		}
+
+		std::optional<RegularBuilder::Fragment> _build(RegularBuilder& builder, std::string_view layout) const {
+			const char delimiters[] = { DELIMITERS... };
+			const auto value = builder.greedy(all_bytes() & ~chars({ delimiters, sizeof...(DELIMITERS) }));
+			return builder.then(value, builder.greedy(chars(layout)));
+		}
+
+	};
+
+
+
+
+
+	class Terminal : public ComposableParser<Terminal> {
+	public:
+		Terminal(std::string what)
+			: _what(what) {
+		}
+
+		template<typename F>
+		void _chain(Trampoline& trampoline, const std::string_view layout, std::string_view str, F f) const {
+			Cursor cursor{ trampoline, str };
+			if (!cursor.match(_what)) {
+				if (cursor.at_end()) {
+					_incomplete(trampoline, layout, str, f);
+					return;
+				}
+
+				trampoline.resume(f, ParserResult{ str, "Terminal missing " + _what });
+				return;
+			}
+
+			cursor.skip(layout);
+			if (cursor.at_end() && !layout.empty() && trampoline.partial()) {
+				_incomplete(trampoline, layout, str, f);
+				return;
+			}
+
+			trampoline.resume(f, ParserResult{ cursor.trail() });
+		}
+
+		std::optional<RegularBuilder::Fragment> _build(RegularBuilder& builder, std::string_view layout) const {
+			return builder.then(builder.literal(_what), builder.greedy(chars(layout)));
+		}
+
+
+		bool _first(TokenAnalysis& analysis, TokenSet& first) const {
+			return _what.empty();
+		}
+
+	private:
+		/// str ends within the terminal or its layout. Kept apart from _chain(), which is on the stack once per nesting
+		/// level of the input.
+		template<typename F>
+		void _incomplete(Trampoline& trampoline, const std::string_view layout, std::string_view str, F f) const {
+			if (_suspend(trampoline, layout, str, f))
+				return;
+
+			trampoline.resume(f, ParserResult{ str, "Terminal missing " + _what });
+		}
+
+		std::string _what;
+	};
+
+
+
+
+
+	template<typename LT, typename RT>
+	class Sequence : public ComposableParser<Sequence<LT, RT>> {
+	public:
+		Sequence(LT lhs, RT rhs)
+			: _lhs(lhs)
+			, _rhs(rhs) {
+			static_assert(std::is_base_of_v<ParserBase, LT>);
+			static_assert(std::is_base_of_v<ParserBase, RT>);
+		}
+
+		template<typename F>
+		void _chain(Trampoline& trampoline, const std::string_view layout, std::string_view str, F f) const {
+			_lhs._chain(trampoline, layout, str, [layout, f, this](Trampoline& trampoline, ParserResult result) {
+				if (!result.is_success()) {
+					f(trampoline, result);
+				}
+				else {
+					_rhs._chain(trampoline, layout, result.trail, f);
+				}
+			});
+		}
+
+		std::optional<RegularBuilder::Fragment> _build(RegularBuilder& builder, std::string_view layout) const {
+			const auto tails = builder.leave_tail();
+			const auto lhs = _lhs._build(builder, layout);
+			builder.restore_tail(tails);
+
+			if (!lhs)
+				return std::nullopt;
+
+			const auto rhs = _rhs._build(builder, layout);
+			if (!rhs)
+				return std::nullopt;
+
+			return builder.then(*lhs, *rhs);
+		}
+
+#if __cpp_impl_coroutine
+		static constexpr bool _calls_rules = LT::_calls_rules || RT::_calls_rules;
+
+		void _spawn(CoroutineScheduler& scheduler, std::string_view layout, size_t position, ResultChannel& out) const {
+			if constexpr (!_calls_rules) {
+				scheduler.chain(*this, layout, position, out);
+			}
+			else if constexpr (!LT::_calls_rules) {
+				scheduler.then(_lhs, _rhs, layout, position, out);
+			}
+			else {
+				scheduler.start(_continue(scheduler, *this, layout, position, out), position);
+			}
+		}
+#endif
+
+		template<typename W>
+		void _walk(W& walker, std::string_view layout) const {
+			_lhs._walk(walker, layout);
+			_rhs._walk(walker, layout);
+		}
+
+		bool _first(TokenAnalysis& analysis, TokenSet& first) const {
+			return _lhs._first(analysis, first) && _rhs._first(analysis, first);
+		}
+
+		int _weight() const {
+			return _lhs._weight();
+		}
+
+		void _expect(TokenAnalysis& analysis, TokenSet expected, TokenSet follow) const {
+			TokenSet rhsExpected;
+			if (_rhs._first(analysis, rhsExpected)) {
+				rhsExpected |= follow;
+			}
+
+			_lhs._expect(analysis, expected, rhsExpected);
+			_rhs._expect(analysis, rhsExpected, follow);
+		}
+
+	private:
+#if __cpp_impl_coroutine
+		/// Match rhs from each position lhs reaches, all in one frame. It waits until it's collected.
+		static ParseTask _continue(CoroutineScheduler& scheduler, const Sequence& self, std::string_view layout, size_t position, ResultChannel& out) {
+			ResultChannel lhs{ &out };
+			self._lhs._spawn(scheduler, layout, position, lhs);
+			for (;;) {
+				self._rhs._spawn(scheduler, layout, co_await lhs, out);
+			}
+		}
+#endif
+
+		LT _lhs;
+		RT _rhs;
+	};
+
+
+
+
+	template<typename LT, typename RT>
+	class Disjunction : public ComposableParser<Disjunction<LT, RT>> {
+	public:
+		Disjunction(LT lhs, RT rhs)
+			: _lhs(lhs)
+			, _rhs(rhs) {
+			static_assert(std::is_base_of_v<ParserBase, LT>);
+			static_assert(std::is_base_of_v<ParserBase, RT>);
+		}
+
+		template<typename F>
+		void _chain(Trampoline& trampoline, std::string_view layout, std::string_view str, F f) const {
+			_gather([&](auto& parser) {
+				if constexpr (std::is_same_v<F, Trampoline::Continuation>) {
+					// Alternatives of a rule body only need the position and the rule's GSS node.
+					if (const auto ret = f.template target<Trampoline::Return>()) {
+						const auto slot = trampoline.slot(&parser, layout, [&parser, layout](Trampoline& trampoline, std::string_view str, Trampoline::GssNode* node) {
+							parser._chain(trampoline, layout, str, Trampoline::Continuation{ Trampoline::Return{ node } });
+						});
+						trampoline.add(slot, str, ret->node, parser._weight());
+						return;
+					}
+				}
+
+				trampoline.add(str, [layout, f, &parser](Trampoline& trampoline, std::string_view str) {
+					parser._chain(trampoline, layout, str, f);
+				}, parser._weight());
+			});
+		}
+
+		template<typename F>
+		void _gather(F f) const {
+			_lhs._gather(f);
+			_rhs._gather(f);
+		}
+
+		std::optional<RegularBuilder::Fragment> _build(RegularBuilder& builder, std::string_view layout) const {
+			const auto lhs = _lhs._build(builder, layout);
+			if (!lhs)
+				return std::nullopt;
+
+			const auto rhs = _rhs._build(builder, layout);
+			if (!rhs)
+				return std::nullopt;
+
+			return builder.either(*lhs, *rhs);
+		}
+
+#if __cpp_impl_coroutine
+		static constexpr bool _calls_rules = LT::_calls_rules || RT::_calls_rules;
+
+		void _spawn(CoroutineScheduler& scheduler, std::string_view layout, size_t position, ResultChannel& out) const {
+			_gather([&](auto& parser) {
+				parser._spawn(scheduler, layout, position, out);
+			});
+		}
+#endif
+
+		template<typename W>
+		void _walk(W& walker, std::string_view layout) const {
+			_lhs._walk(walker, layout);
+			_rhs._walk(walker, layout);
+		}
+
+		bool _first(TokenAnalysis& analysis, TokenSet& first) const {
+			const auto lhs = _lhs._first(analysis, first);
+			const auto rhs = _rhs._first(analysis, first);
+			return lhs || rhs;
+		}
+
+		void _expect(TokenAnalysis& analysis, TokenSet expected, TokenSet follow) const {
+			_lhs._expect(analysis, expected, follow);
+			_rhs._expect(analysis, expected, follow);
+		}
+
+	private:
+		LT _lhs;
+		RT _rhs;
+	};
+
+
+
+
+
+	constexpr size_t UNBOUNDED = SIZE_MAX;
+
+	/// Between MIN and MAX matches of P, separated by S. Loops within one call while each element has exactly one
+	/// synchronous result; only ambiguous or deferred elements go through the Trampoline. Per invocation there is
+	/// one shared loop state, elements don't nest continuations.
+	template<typename P, typename S, size_t MIN, size_t MAX>
+	class Repetition : public ComposableParser<Repetition<P, S, MIN, MAX>> {
+	public:
+		static_assert(MIN <= MAX);
+
+		Repetition(P p, S separator)
+			: _p(p)
+			, _next(separator, p) {
+			static_assert(std::is_base_of_v<ParserBase, P>);
+			static_assert(std::is_base_of_v<ParserBase, S>);
+		}
+
+		template<typename F>
+		void _chain(Trampoline& trampoline, const std::string_view layout, std::string_view str, F f) const {
+			std::make_shared<Loop<F>>(*this, layout, f)->run(trampoline, 0, str);
+		}
+
+		std::optional<RegularBuilder::Fragment> _build(RegularBuilder& builder, std::string_view layout) const {
+			const auto tails = builder.leave_tail();
+			auto fragment = _build_elements(builder, layout);
+			builder.restore_tail(tails);
+			return fragment;
+		}
+
+#if __cpp_impl_coroutine
+		static constexpr bool _calls_rules = P::_calls_rules || S::_calls_rules;
+
+		void _spawn(CoroutineScheduler& scheduler, std::string_view layout, size_t position, ResultChannel& out) const {
+			if constexpr (!_calls_rules) {
+				scheduler.chain(*this, layout, position, out);
+			}
+			else {
+				scheduler.start(_step(scheduler, *this, layout, position, out, 0, std::make_shared<std::set<std::pair<size_t, size_t>>>()), position);
+			}
+		}
+#endif
+
+		template<typename W>
+		void _walk(W& walker, std::string_view layout) const {
+			_next._walk(walker, layout);
+		}
+
+		bool _first(TokenAnalysis& analysis, TokenSet& first) const {
+			return _p._first(analysis, first) || MIN == 0;
+		}
+
+		void _expect(TokenAnalysis& analysis, TokenSet expected, TokenSet follow) const {
+			TokenSet next;
+			if (MAX > 1 && _next._first(analysis, next)) {
+				next |= follow;
+			}
+
+			_p._expect(analysis, expected | next, next | follow);
+			_next._expect(analysis, next, next | follow);
+		}
+
+	private:
+		/// Owned by the continuations that refer to it.
+		template<typename F>
+		class Loop : public std::enable_shared_from_this<Loop<F>> {
+		public:
+			Loop(const Repetition& repetition, std::string_view layout, F f)
+				: _repetition(repetition)
+				, _layout(layout)
+				, _f(f) {
+			}
+
+			void run(Trampoline& trampoline, size_t count, std::string_view str) {
+				for (;;) {
+					if (count >= MIN) {
+						trampoline.resume(_f, ParserResult{ str });
+					}
+
+					if (count == MAX)
+						return;
+
+					const auto step = _begin_step(trampoline);
+					const auto next = [self = this->shared_from_this(), count, step](Trampoline& trampoline, ParserResult result) {
+						self->_element(trampoline, count, step, result);
+					};
+
+					if (count == 0) {
+						_repetition._p._chain(trampoline, _layout, str, next);
+					}
+					else {
+						_repetition._next._chain(trampoline, _layout, str, next);
+					}
+
+					auto results = _end_step(trampoline, step);
+					std::optional<std::string_view> continuation;
+					for (auto& result : results) {
+						// Elements that don't consume input can't reach anything new once MIN is reached.
+						if (result.trail.data() == str.data() && count >= MIN)
+							continue;
+
+						if (!continuation) {
+							continuation = result.trail;
+						}
+						else {
+							_defer(trampoline, count + 1, result.trail);
+						}
+					}
+					_recycle(trampoline, std::move(results));
+
+					if (!continuation)
+						return;
+
+					++count;
+					str = *continuation;
+				}
+			}
+
+		private:
+			void _element(Trampoline& trampoline, size_t count, size_t step, ParserResult result) {
+				if (!result.is_success()) {
+					trampoline.resume(_f, result);
+					return;
+				}
+
+				{
+					const auto lock = trampoline.lock(_mutex);
+					for (auto& running : _steps) {
+						if (running.first == step) {
+							running.second.push_back(result);
+							return;
+						}
+					}
+				}
+				_defer(trampoline, count + 1, result.trail);
+			}
+
+			/// Start collecting the results an element passes while it's being stepped to. Several threads may step
+			/// the same loop at once, so each step has its own results. Their vectors are recycled.
+			size_t _begin_step(Trampoline& trampoline) {
+				const auto lock = trampoline.lock(_mutex);
+				std::vector<ParserResult> results;
+				if (!_spare.empty()) {
+					results = std::move(_spare.back());
+					_spare.pop_back();
+				}
+
+				_steps.emplace_back(++_serial, std::move(results));
+				return _serial;
+			}
+
+			std::vector<ParserResult> _end_step(Trampoline& trampoline, size_t step) {
+				const auto lock = trampoline.lock(_mutex);
+				const auto it = std::find_if(_steps.begin(), _steps.end(), [step](const auto& running) {
+					return running.first == step;
+				});
+
+				auto results = std::move(it->second);
+				*it = std::move(_steps.back());
+				_steps.pop_back();
+				return results;
+			}
+
+			void _recycle(Trampoline& trampoline, std::vector<ParserResult> results) {
+				results.clear();
+				const auto lock = trampoline.lock(_mutex);
+				_spare.push_back(std::move(results));
+			}
+
+			/// Continue from an ambiguous or late element. Each (position, count) is only continued once, counts
+			/// beyond MIN are all alike if there's no maximum. Positions behind the frontier can't come up again.
+			void _defer(Trampoline& trampoline, size_t count, std::string_view str) {
+				const auto key = std::make_pair(trampoline.position(str), MAX == UNBOUNDED ? std::min(count, MIN) : count);
+				{
+					const auto lock = trampoline.lock(_mutex);
+					_deferred.erase(_deferred.begin(), _deferred.lower_bound({ trampoline.frontier(), 0 }));
+					if (!_deferred.insert(key).second)
+						return;
+				}
+
+				trampoline.add(str, [self = this->shared_from_this(), count](Trampoline& trampoline, std::string_view str) {
+					self->run(trampoline, count, str);
+				});
+			}
+
+			const Repetition& _repetition;
+			std::string_view _layout;
+			F _f;
+			/// Steps in progress by serial, with the results passed to them so far.
+			std::vector<std::pair<size_t, std::vector<ParserResult>>> _steps;
+			std::vector<std::vector<ParserResult>> _spare;
+			size_t _serial = 0;
+			std::set<std::pair<size_t, size_t>> _deferred;
+			std::mutex _mutex;
+		};
+
+		std::optional<RegularBuilder::Fragment> _build_element(RegularBuilder& builder, std::string_view layout, size_t count) const {
+			if (builder.full())
+				return std::nullopt;
+
+			return count == 0 ? _p._build(builder, layout) : _next._build(builder, layout);
+		}
+
+		std::optional<RegularBuilder::Fragment> _build_elements(RegularBuilder& builder, std::string_view layout) const {
+			auto fragment = builder.empty();
+			for (size_t count = 0; count < MIN; ++count) {
+				const auto element = _build_element(builder, layout, count);
+				if (!element)
+					return std::nullopt;
+
+				fragment = builder.then(fragment, *element);
+			}
+
+			if (MAX == UNBOUNDED) {
+				const auto element = _build_element(builder, layout, std::max<size_t>(MIN, 1));
+				if (!element)
+					return std::nullopt;
+
+				const auto loop = builder.empty();
+				builder.nfa.add_epsilon(loop.start, element->start);
+				builder.nfa.add_epsilon(element->end, loop.start);
+
+				if (MIN > 0)
+					return builder.then(fragment, loop);
+
+				const auto first = _build_element(builder, layout, 0);
+				if (!first)
+					return std::nullopt;
+
+				return builder.either(builder.then(*first, loop), fragment);
+			}
+
+			auto rest = builder.empty();
+			for (size_t count = MAX; count-- > MIN;) {
+				const auto element = _build_element(builder, layout, count);
+				if (!element)
+					return std::nullopt;
+
+				rest = builder.either(builder.then(*element, rest), builder.empty());
+			}
+			return builder.then(fragment, rest);
+		}
+
+#if __cpp_impl_coroutine
+		/// Pass position on once there are MIN elements, and continue with count + 1 elements from each position the
+		/// next element reaches. Like Loop::_defer(), each (position, count) only continues once; the steps of a
+		/// Repetition share the ones started.
+		static ParseTask _step(CoroutineScheduler& scheduler, const Repetition& self, std::string_view layout, size_t position, ResultChannel& out, size_t count, std::shared_ptr<std::set<std::pair<size_t, size_t>>> started) {
+			if (count >= MIN) {
+				scheduler.push(out, position);
+			}
+
+			if (count == MAX)
+				co_return;
+
+			ResultChannel elements{ &out };
+			if (count == 0) {
+				self._p._spawn(scheduler, layout, position, elements);
+			}
+			else {
+				self._next._spawn(scheduler, layout, position, elements);
+			}
+
+			for (;;) {
+				const auto next = co_await elements;
+				// Elements that don't consume input can't reach anything new once MIN is reached.
+				if (next == position && count >= MIN)
+					continue;
+
+				if (started->insert({ next, MAX == UNBOUNDED ? std::min(count + 1, MIN) : count + 1 }).second) {
+					scheduler.start(_step(scheduler, self, layout, next, out, count + 1, started), next);
+				}
+			}
+		}
+#endif
+
+		P _p;
+		Sequence<S, P> _next;
+	};
+
+
+
+
+
+	/// Collects every rule reachable from a grammar together with the layouts it's used with.
+	class RuleWalker {
+	public:
+		void visit(const Parser& rule, std::string_view layout) {
+			for (auto& visited : rules) {
+				if (visited.first._id() == rule._id() && visited.second == layout)
+					return;
+			}
+
+			rules.emplace_back(rule, layout);
+			rule._walk_body(*this, layout);
+		}
+
+		std::vector<std::pair<Parser, std::string>> rules;
+	};
+
+
+	/// State shared by a Lexer and its TokenParsers. Automata are built on first use, which may happen in several
+	/// parses at once (see ComposableParser::parse_batch). Defining tokens and analyze() may not.
+	class LexerData {
+	public:
+		LexerData(std::string_view layout)
+			: layout(chars(layout))
+			, sets{ TokenSet{}.set() } {
+			dfas.emplace_back(nullptr);
+		}
+
+		/// DFA matching any of the tokens in the interned set, skipped tokens excluded.
+		const Dfa& dfa(uint16_t set) {
+			return _lazy(dfas[set], [&]() {
+				TokenSet kinds = sets[set];
+				for (size_t kind = 0; kind < skipped.size(); ++kind) {
+					if (skipped[kind])
+						kinds.reset(kind);
+				}
+				return _build(kinds);
+			});
+		}
+
+		/// DFA matching any token including skipped ones, as tokenize() does.
+		const Dfa& tokenizer() {
+			return _lazy(all, [&]() {
+				return _build(TokenSet{}.set());
+			});
+		}
+
+		/// Length of the layout and skipped tokens the input at position starts with. Nothing if the input is partial
+		/// and they reach its end.
+		std::optional<size_t> skip(const Trampoline& trampoline, size_t position) {
+			const auto& skips = _lazy(this->skips, [&]() {
+				TokenSet kinds;
+				for (size_t kind = 0; kind < skipped.size(); ++kind) {
+					if (skipped[kind])
+						kinds.set(kind);
+				}
+				return _build(kinds);
+			});
+
+			for (size_t offset = 0;;) {
+				Cursor cursor{ trampoline, trampoline.input(position + offset) };
+				cursor.skip_while([this](char c) {
+					return layout.test(static_cast<unsigned char>(c));
+				});
+
+				if (cursor.at_end() && trampoline.partial())
+					return std::nullopt;
+
+				offset = trampoline.position(cursor.trail()) - position;
+				const auto [length, kind] = trampoline.longest(skips, position + offset);
+				if (kind == Dfa::MORE)
+					return std::nullopt;
+
+				if (kind < 0 || length == 0)
+					return offset;
+
+				offset += length;
+			}
+		}
+
+		/// Longest token of the set after layout at position, including the layout following it. Returns (consumed
+		/// length, kind), kind is Dfa::MORE if the input is partial and has to grow to tell.
+		std::pair<size_t, int32_t> scan(const Trampoline& trampoline, size_t position, uint16_t set) {
+			const auto offset = skip(trampoline, position);
+			if (!offset)
+				return { 0, Dfa::MORE };
+
+			const auto [length, kind] = trampoline.longest(dfa(set), position + *offset);
+			if (kind == Dfa::MORE)
+				return { 0, Dfa::MORE };
+
+			if (kind < 0 || length == 0)
+				return { *offset, -1 };
+
+			const auto after = skip(trampoline, position + *offset + length);
+			if (!after)
+				return { 0, Dfa::MORE };
+
+			return { *offset + length + *after, kind };
+		}
+
+		uint16_t intern(TokenSet set) {
+			const auto it = std::find(sets.begin(), sets.end(), set);
+			if (it != sets.end())
+				return static_cast<uint16_t>(it - sets.begin());
+
+			sets.push_back(set);
+			dfas.emplace_back(nullptr);
+			return static_cast<uint16_t>(sets.size() - 1);
+		}
+
+		/// Token definitions changed, drop all automata.
+		void invalidate() {
+			for (auto& dfa : dfas) {
+				dfa = nullptr;
+			}
+			all = nullptr;
+			skips = nullptr;
+			built.clear();
+		}
+
+		RegularBuilder builder;
+		CharSet layout;
+		/// NFA start state per token kind.
+		std::vector<uint32_t> starts;
+		std::vector<bool> skipped;
+		/// Interned token sets, set 0 contains all tokens.
+		std::vector<TokenSet> sets;
+
+	private:
+		Dfa _build(const TokenSet& kinds) const {
+			auto nfa = builder.nfa;
+			const auto start = nfa.add_state();
+			for (size_t kind = 0; kind < starts.size(); ++kind) {
+				if (kinds.test(kind)) {
+					nfa.add_epsilon(start, starts[kind]);
+				}
+			}
+
+			auto dfa = Dfa::build(nfa, start);
+			if (!dfa)
+				throw std::length_error("Gllpp::Lexer token definitions need too many DFA states");
+
+			return std::move(*dfa);
+		}
+
+		/// The automaton in slot, built by build() if there is none yet.
+		template<typename F>
+		const Dfa& _lazy(std::atomic<const Dfa*>& slot, F build) {
+			if (const auto dfa = slot.load(std::memory_order_acquire))
+				return *dfa;
+
+			std::lock_guard<std::mutex> lock{ mutex };
+			if (const auto dfa = slot.load(std::memory_order_relaxed))
+				return *dfa;
+
+			built.push_back(build());
+			slot.store(&built.back(), std::memory_order_release);
+			return built.back();
+		}
+
+		/// Automata per interned set, nullptr until built. A deque, as atomics can't move.
+		std::deque<std::atomic<const Dfa*>> dfas;
+		std::atomic<const Dfa*> all{ nullptr };
+		std::atomic<const Dfa*> skips{ nullptr };
+		/// Owns the automata, which keep their address.
+		std::deque<Dfa> built;
+		std::mutex mutex;
+	};
+
+
+	/// Matches one token of a Lexer. When parsing a TokenStream it compares the kind of the next token. When parsing
+	/// bytes it lexes on demand, only considering the tokens expected at this point of the grammar (see Lexer::analyze,
+	/// all tokens otherwise). Scans are cached per position and token set, so all branches share them.
+	class TokenParser : public ComposableParser<TokenParser> {
+	public:
+		TokenParser(uint8_t kind, std::string name, std::shared_ptr<LexerData> lexer)
+			: _kind(kind)
+			, _name(name)
+			, _lexer(lexer) {
+		}
+
+		template<typename F>
+		void _chain(Trampoline& trampoline, const std::string_view layout, std::string_view str, F f) const {
+			if (trampoline.tokens() != nullptr) {
+				if (str.empty() || static_cast<uint8_t>(str[0]) != _kind) {
+					trampoline.resume(f, ParserResult{ str, "Token missing " + _name });
+					return;
+				}
+
+				trampoline.resume(f, ParserResult{ str.substr(1) });
+				return;
+			}
+
+			const auto position = trampoline.position(str);
+			const auto [length, kind] = trampoline.lex(_lexer.get(), position, _set, [&]() {
+				return _lexer->scan(trampoline, position, _set);
+			});
+
+			if (kind == Dfa::MORE) {
+				_suspend(trampoline, layout, str, f);
+				return;
+			}
+
+			if (kind != _kind) {
+				trampoline.resume(f, ParserResult{ str, "Token missing " + _name });
+				return;
+			}
+
+			trampoline.resume(f, ParserResult{ trampoline.advance(str, length) });
+		}
+
+		bool _first(TokenAnalysis& analysis, TokenSet& first) const {
+			first.set(_kind);
+			return false;
+		}
+
+		void _expect(TokenAnalysis& analysis, TokenSet expected, TokenSet follow) const {
+			expected.set(_kind);
+			analysis.expect(this, expected);
+		}
+
+		void _set_expected(uint16_t set) const {
+			_set = set;
+		}
+
+		uint8_t kind() const {
+			return _kind;
+		}
+
+	private:
+		uint8_t _kind;
+		std::string _name;
+		std::shared_ptr<LexerData> _lexer;
+		mutable uint16_t _set = 0;
+	};
+
+
+	/// Scanner generated from regular token definitions. tokenize() skips layout and splits the source into the
+	/// longest matching tokens in one pass, earlier definitions win ties. Grammars over the resulting TokenStream
+	/// use TokenParsers instead of Terminals and don't need Layout.
+	///
+	/// The same grammar can also parse the source directly, in which case the TokenParsers lex on demand. After
+	/// analyze() each of them only considers the tokens valid at its point of the grammar, so the same bytes can
+	/// lex differently depending on context (e.g. ">>" closing two template argument lists).
+	class Lexer {
+	public:
+		Lexer(std::string layout = {})
+			: _data(std::make_shared<LexerData>(layout)) {
+		}
+
+		template<typename P>
+		TokenParser token(std::string name, P definition) {
+			return { _add(definition, false), name, _data };
+		}
+
+		/// Tokens matching definition are dropped, e.g. comments.
+		template<typename P>
+		void skip(P definition) {
+			_add(definition, true);
+		}
+
+		TokenStream tokenize(std::string_view source) const {
+			const auto& dfa = _data->tokenizer();
+
+			TokenStream stream{ source };
+			for (size_t offset = 0;;) {
+				while (offset < source.size() && _data->layout.test(static_cast<unsigned char>(source[offset])))
+					++offset;
+
+				if (offset == source.size())
+					break;
+
+				const auto [length, kind] = dfa.longest(source.substr(offset));
+				if (kind < 0 || length == 0) {
+					stream.error = offset;
+					break;
+				}
+
+				if (!_data->skipped[kind]) {
+					stream.tokens.push_back({ static_cast<uint32_t>(kind), static_cast<uint32_t>(offset), static_cast<uint32_t>(length) });
+					stream.kinds.push_back(static_cast<char>(kind));
+				}
+				offset += length;
+			}
+
+			return stream;
+		}
+
+		/// FIRST/FOLLOW analysis of grammar. Assigns every TokenParser in it the set of tokens expected where it's
+		/// used: all tokens the enclosing alternatives can start with, plus what may follow if they can be empty.
+		template<typename P>
+		void analyze(const P& grammar) const {
+			RuleWalker walker;
+			grammar._walk(walker, {});
+
+			TokenAnalysis analysis;
+			do {
+				analysis.changed = false;
+				for (auto& rule : walker.rules) {
+					TokenSet first;
+					const auto nullable = rule.first._first_body(analysis, first);
+					analysis.set_first(rule.first._id(), first, nullable);
+				}
+			} while (analysis.changed);
+
+			TokenSet first;
+			grammar._first(analysis, first);
+			do {
+				analysis.changed = false;
+				grammar._expect(analysis, first, {});
+				for (auto& rule : walker.rules) {
+					const auto info = analysis.rules[rule.first._id()];
+					rule.first._expect_body(analysis, info.entry, info.follow);
+				}
+			} while (analysis.changed);
+
+			for (auto& [token, expected] : analysis.tokens) {
+				token->_set_expected(_data->intern(expected));
+			}
+		}
+
+	private:
+		template<typename P>
+		uint8_t _add(P definition, bool skipped) {
+			static_assert(std::is_base_of_v<ParserBase, P>);
+			if (_data->skipped.size() > UINT8_MAX)
+				throw std::length_error("Gllpp::Lexer supports at most 256 token kinds");
+
+			const auto fragment = definition._build(_data->builder, {});
+			if (!fragment)
+				throw std::invalid_argument("Gllpp::Lexer token definitions have to be regular");
+
+			const auto kind = static_cast<uint8_t>(_data->skipped.size());
+			_data->builder.nfa.set_accept(fragment->end, kind);
+			_data->starts.push_back(fragment->start);
+			_data->skipped.push_back(skipped);
+			_data->invalidate();
+			return kind;
+		}
+
+		std::shared_ptr<LexerData> _data;
+	};
+
+
+
+
+	struct CompileReport {
+		struct Rule {
+			std::string name;
+			std::string layout;
+			size_t states;
+		};
+
+		std::vector<Rule> converted;
+	};
+
+	inline std::ostream& operator<<(std::ostream& out, const CompileReport& report) {
+		for (auto& rule : report.converted) {
+			out << (rule.name.empty() ? "<unnamed>" : rule.name) << ": " << rule.states << " DFA states" << std::endl;
+		}
+		return out;
+	}
+
+	/// Replace every rule reachable from grammar that is regular, i.e. only refers back to itself in tail position,
+	/// by a DFA. The DFA reports the same set of trails, but ambiguous derivations of one trail collapse into one
+	/// result and failures only report the rule. Has to be called again after rules are reassigned.
+	inline CompileReport compile(const Parser& grammar) {
+		RuleWalker walker;
+		grammar._walk(walker, {});
+
+		CompileReport report;
+		for (auto& [rule, layout] : walker.rules) {
+			RegularBuilder builder;
+			const auto fragment = rule._build(builder, layout);
+			if (!fragment)
+				continue;
+
+			builder.nfa.set_accept(fragment->end, 0);
+			auto dfa = Dfa::build(builder.nfa, fragment->start);
+			if (!dfa)
+				continue;
+
+			report.converted.push_back({ rule.name(), layout, dfa->state_count() });
+			rule._set_regular(layout, std::make_shared<const Dfa>(std::move(*dfa)));
+		}
+
+		return report;
+	}
+
+
+
+
+	/// Parse input that arrives in chunks, e.g. from a socket. Parsers that run into the end of the input received so
+	/// far suspend until the next push(). With Schedule::POSITION the input the parse is done with is dropped, so
+	/// memory stays bounded by how far the grammar looks back rather than by the size of the input.
+	class StreamingParse {
+	public:
+		StreamingParse(Parser grammar, const ParseOptions& options = {})
+			: _grammar(grammar)
+			, _trampoline(std::string_view{}, options) {
+			_trampoline.feed(_buffer, 0, false);
+			_grammar._begin(_trampoline, _buffer, options, _scheduler, [this](Trampoline& trampoline, ParserResult result) {
+				_collector.add(trampoline, result);
+			});
+			_trampoline.run();
+		}
+
+		StreamingParse(const StreamingParse&) = delete;
+		StreamingParse& operator=(const StreamingParse&) = delete;
+
+		void push(std::string_view chunk) {
+			_buffer.append(chunk);
+			_trampoline.feed(_buffer, _base, false);
+			_trampoline.run();
+
+			// Results collected so far are reported as "Tail left" if none get further, so their input is kept too. Input
+			// is only dropped once that's at least half the buffer, which moves every byte a constant number of times.
+			auto horizon = _trampoline.horizon();
+			if (!_collector.empty()) {
+				horizon = std::min(horizon, _collector.position());
+			}
+
+			const auto done = horizon - _base;
+			if (done > 0 && done * 2 >= _buffer.size()) {
+				_buffer.erase(0, done);
+				_base += done;
+			}
+		}
+
+		/// End of the input. Returns the same as ComposableParser::parse() on the whole input, trails point into a
+		/// buffer that lives as long as this.
+		std::vector<ParserResult> finish() {
+			_trampoline.feed(_buffer, _base, true);
+			_trampoline.run();
+			return _collector.results(_trampoline);
+		}
+
+		/// Bytes of input currently kept.
+		size_t buffered() const {
+			return _buffer.size();
+		}
+
+	private:
+		Parser _grammar;
+		std::string _buffer;
+		size_t _base = 0;
+		ResultCollector _collector;
+		Trampoline _trampoline;
+		std::optional<CoroutineScheduler> _scheduler;
+	};
+
+
+
+
+
+	/// Parse that runs in slices, e.g. between the events of a UI loop. Each run_for() continues where the last one
+	/// stopped, the state of the parse stays in its Trampoline in between. str and grammar have to outlive it.
+	class ResumableParse {
+	public:
+		ResumableParse(Parser grammar, std::string_view str, const ParseOptions& options = {})
+			: _grammar(grammar)
+			, _trampoline(str, options) {
+			_grammar._begin(_trampoline, str, options, _scheduler, [this](Trampoline& trampoline, ParserResult result) {
+				_collector.add(trampoline, result);
+			});
+		}
+
+		ResumableParse(const ResumableParse&) = delete;
+		ResumableParse& operator=(const ResumableParse&) = delete;
+
+		/// Run at most descriptors steps of the parse, and for about time at most. Returns whether it's done.
+		bool run_for(size_t descriptors, std::chrono::steady_clock::duration time = std::chrono::steady_clock::duration::max()) {
+			if (!_done) {
+				_done = _trampoline.run_for(descriptors, time);
+			}
+			return _done;
+		}
+
+		bool done() const {
+			return _done;
+		}
+
+		/// Steps queued for the next run_for().
+		size_t pending() const {
+			return _trampoline.pending();
+		}
+
+		/// Whether the parse settled for the first parse, see ParseOptions::degrade_after.
+		bool degraded() const {
+			return _trampoline.degraded();
+		}
+
+		/// Runs what is left of the parse. Returns the same as ComposableParser::parse().
+		std::vector<ParserResult> results() {
+			if (!_done) {
+				_trampoline.run();
+				_done = true;
+			}
+			return _collector.results(_trampoline);
+		}
+
+	private:
+		Parser _grammar;
+		ResultCollector _collector;
+		Trampoline _trampoline;
+		std::optional<CoroutineScheduler> _scheduler;
+		bool _done = false;
+	};
+
+
+
+
+
+	/// Parse of a document that changes by edits, e.g. in an editor. Each rule call of a parse is kept as a
+	/// Trampoline::Memo together with the input it looked at. The next parse takes the results of calls whose input
+	/// wasn't edited from there, so only the rules around an edit run again. A right-recursive list is a call per
+	/// element, the elements before an edit run again and the first call after it answers the rest of the list. Lists
+	/// parsed as many() of a rule also reuse the elements before the edit.
+	class IncrementalParse {
+	public:
+		IncrementalParse(Parser grammar, std::string text, const ParseOptions& options = {})
+			: _grammar(grammar)
+			, _text(std::move(text))
+			, _options(options) {
+			_parse();
+		}
+
+		/// Replace removed bytes at offset by inserted and parse again. Throws std::out_of_range if they aren't part
+		/// of the text.
+		const std::vector<ParserResult>& edit(size_t offset, size_t removed, std::string_view inserted) {
+			if (offset > _text.size() || removed > _text.size() - offset)
+				throw std::out_of_range("Gllpp::IncrementalParse edit outside of the text");
+
+			_text.replace(offset, removed, inserted);
+
+			// Calls that only looked before the edit stay, the ones after it move along, the rest is dropped.
+			const auto shift = [delta = inserted.size() - removed](size_t& position) {
+				position += delta;
+			};
+
+			size_t kept = 0;
+			for (size_t i = 0; i < _memos.size(); ++i) {
+				auto& memo = _memos[i];
+				if (memo.examined > offset) {
+					if (memo.position < offset + removed)
+						continue;
+
+					shift(memo.position);
+					shift(memo.examined);
+					shift(memo.failurePosition);
+					std::for_each(memo.results.begin(), memo.results.end(), shift);
+				}
+
+				if (kept != i) {
+					_memos[kept] = std::move(memo);
+				}
+				++kept;
+			}
+			_memos.erase(_memos.begin() + kept, _memos.end());
+
+			_parse();
+			return _results;
+		}
+
+		const std::vector<ParserResult>& results() const {
+			return _results;
+		}
+
+		/// Current text, which the trails of the results point into.
+		const std::string& text() const {
+			return _text;
+		}
+
+		/// Rule calls of the last parse that were answered from the earlier one.
+		size_t reused() const {
+			return _reused;
+		}
+
+		/// Rule calls of the last parse whose bodies ran.
+		size_t computed() const {
+			return _computed;
+		}
+
+	private:
+		void _parse() {
+			Trampoline trampoline{ _text, _options };
+			trampoline.record(&_memos);
+
+			ResultCollector collector;
+			_grammar._chain(trampoline, {}, _text, [&collector](Trampoline& trampoline, ParserResult result) {
+				collector.add(trampoline, result);
+			});
+			trampoline.run();
+			_results = collector.results(trampoline);
+
+			// Calls that ran replace the memos of the same call, the others stay for later edits.
+			auto memos = trampoline.memos();
+			_reused = trampoline.reused();
+			_computed = memos.size();
+
+			const auto middle = memos.size();
+			memos.reserve(middle + _memos.size());
+			std::move(_memos.begin(), _memos.end(), std::back_inserter(memos));
+			std::inplace_merge(memos.begin(), memos.begin() + middle, memos.end(), [](const Trampoline::Memo& lhs, const Trampoline::Memo& rhs) {
+				return lhs.position < rhs.position;
+			});
+
+			_memos.clear();
+			for (auto& memo : memos) {
+				// Within a position, the calls of this parse come first.
+				auto duplicate = false;
+				for (auto it = _memos.rbegin(); it != _memos.rend() && it->position == memo.position; ++it) {
+					duplicate |= it->rule == memo.rule && it->layout.data() == memo.layout.data() && it->layout.size() == memo.layout.size();
+				}
+				if (!duplicate) {
+					_memos.push_back(std::move(memo));
+				}
+			}
+		}
+
+		Parser _grammar;
+		std::string _text;
+		ParseOptions _options;
+		std::vector<ParserResult> _results;
+		std::vector<Trampoline::Memo> _memos;
+		size_t _reused = 0;
+		size_t _computed = 0;
+	};
+
+
+
+
+
+	Terminal operator ""_t(const char* str, size_t size) {
+		return std::string{ str, size };
+	}
+
+	template<typename P>
+	Disjunction<P, Empty> optional(P p) {
+		static_assert(std::is_base_of_v<ParserBase, P>);
+		return { p, Empty() };
+	}
+
+	/// Zero or more p.
+	template<typename P>
+	Repetition<P, Empty, 0, UNBOUNDED> many(P p) {
+		return { p, Empty() };
+	}
+
+	/// One or more p.
+	template<typename P>
+	Repetition<P, Empty, 1, UNBOUNDED> many1(P p) {
+		return { p, Empty() };
+	}
+
+	/// Zero or more p separated by separator.
+	template<typename P, typename S>
+	Repetition<P, S, 0, UNBOUNDED> sep_by(P p, S separator) {
+		return { p, separator };
+	}
+
+	/// Between MIN and MAX p.
+	template<size_t MIN, size_t MAX, typename P>
+	Repetition<P, Empty, MIN, MAX> repeat(P p) {
+		return { p, Empty() };
+	}
+
+
+
+
+	/// Parse str as many(definition) on threads workers (0 for one per core). str is split into chunks where the rule
+	/// definition.set_sync() marked matches, guessing that a definition begins there, and the chunks are parsed on
+	/// their own with ComposableParser::parse_batch(). A chunk fails if a guess was wrong, e.g. the rule matched
+	/// within a comment. It's parsed again together with the next chunk, the others are kept. Returns the results of
+	/// parsing the last chunk, or the chunk str fails in; their trails end where the chunk does. Throws
+	/// std::invalid_argument if definition has no sync rule.
+	inline std::vector<ParserResult> parse_definitions(const Parser& definition, std::string_view str, const ParseOptions& options = {}, size_t threads = 0) {
+		const auto sync = definition.sync();
+		if (sync == nullptr)
+			throw std::invalid_argument("Gllpp::parse_definitions() needs a definition with a sync rule");
+
+		if (threads == 0) {
+			threads = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+		}
+		const auto definitions = many(definition);
+
+		// Chunk boundaries, a few chunks per worker so they can balance uneven ones. The sync rule is only run at
+		// bytes it can start with.
+		std::array<bool, 256> starts{};
+		for (size_t c = 0; c < starts.size(); ++c) {
+			const auto first = static_cast<char>(c);
+			starts[c] = sync->longest({ &first, 1 }, true).second != -1;
+		}
+
+		const auto chunkSize = std::max<size_t>(str.size() / (threads * 4), 1);
+		std::vector<size_t> boundaries{ 0 };
+		for (auto at = chunkSize; at < str.size(); ++at) {
+			if (starts[static_cast<uint8_t>(str[at])] && sync->longest(str.substr(at)).second >= 0) {
+				boundaries.push_back(at);
+				at += chunkSize - 1;
+			}
+		}
+		boundaries.push_back(str.size());
+
+		// Chunks that matched stay as they are.
+		std::vector<bool> matched(boundaries.size() - 1, false);
+		std::vector<ParserResult> last;
+		for (;;) {
+			std::vector<std::string_view> chunks;
+			std::vector<size_t> indices;
+			for (size_t i = 0; i < matched.size(); ++i) {
+				if (!matched[i]) {
+					chunks.push_back(str.substr(boundaries[i], boundaries[i + 1] - boundaries[i]));
+					indices.push_back(i);
+				}
+			}
+
+			auto results = definitions.parse_batch(chunks, options, threads);
+			for (size_t i = 0; i < chunks.size(); ++i) {
+				matched[indices[i]] = results[i][0].is_success();
+			}
+
+			// A failed chunk after one that matched holds the failure if it's the last, or if its parse didn't get
+			// to its end, so its end isn't to blame.
+			for (size_t i = 0; i < chunks.size(); ++i) {
+				const auto index = indices[i];
+				if (matched[index] || (index > 0 && !matched[index - 1]))
+					continue;
+
+				const auto reachedEnd = std::any_of(results[i].begin(), results[i].end(), [](const ParserResult& result) {
+					return result.trail.empty();
+				});
+				if (index + 1 == matched.size() || !reachedEnd)
+					return std::move(results[i]);
+			}
+
+			if (indices.back() + 1 == matched.size()) {
+				last = std::move(results.back());
+			}
+			if (std::find(matched.begin(), matched.end(), false) == matched.end())
+				return last;
+
+			// The end of a failed chunk wasn't the start of a definition, or its start wasn't either and the chunk
+			// before failed too. Either way, it's joined with the next chunk.
+			std::vector<size_t> joined{ 0 };
+			std::vector<bool> joinedMatched;
+			for (size_t i = 0; i < matched.size(); ++i) {
+				if (!matched[i] && i + 1 < matched.size()) {
+					++i;
+					joined.push_back(boundaries[i + 1]);
+					joinedMatched.push_back(false);
+					continue;
+				}
+
+				joined.push_back(boundaries[i + 1]);
+				joinedMatched.push_back(matched[i]);
+			}
+
+			boundaries = std::move(joined);
+			matched = std::move(joinedMatched);
+		}
+	}
+}
@@ -0,0 +1,182 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace Gllpp {
+	/// Read-only view of a file's contents. Regular files are mapped into memory, anything that can't be mapped
+	/// (pipes, files in /proc that report no size) is read into a buffer instead. The view stays at the same address
+	/// when the MappedFile is moved.
+	class MappedFile {
+	public:
+		/// Throws std::system_error if path can't be opened or read.
+		explicit MappedFile(const std::string& path) {
+#ifdef _WIN32
+			const auto file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+			if (file == INVALID_HANDLE_VALUE)
+				_fail("Gllpp: can't open " + path);
+
+			LARGE_INTEGER size;
+			if (GetFileType(file) == FILE_TYPE_DISK && GetFileSizeEx(file, &size) && size.QuadPart > 0) {
+				const auto mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+				if (mapping != nullptr) {
+					const auto data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+					CloseHandle(mapping);
+					if (data != nullptr) {
+						CloseHandle(file);
+						_mapping = data;
+						_view = { static_cast<const char*>(data), static_cast<size_t>(size.QuadPart) };
+						return;
+					}
+				}
+			}
+
+			char chunk[16 * 1024];
+			for (;;) {
+				DWORD numRead;
+				if (!ReadFile(file, chunk, sizeof(chunk), &numRead, nullptr)) {
+					// Pipes report their end as an error.
+					const auto error = GetLastError();
+					if (error == ERROR_BROKEN_PIPE)
+						break;
+
+					CloseHandle(file);
+					SetLastError(error);
+					_fail("Gllpp: can't read " + path);
+				}
+				if (numRead == 0)
+					break;
+
+				_buffer.insert(_buffer.end(), chunk, chunk + numRead);
+			}
+			CloseHandle(file);
+#else
+			const auto file = ::open(path.c_str(), O_RDONLY);
+			if (file < 0)
+				_fail("Gllpp: can't open " + path);
+
+			struct stat info;
+			if (fstat(file, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0) {
+				const auto size = static_cast<size_t>(info.st_size);
+				const auto data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, file, 0);
+				if (data != MAP_FAILED) {
+					::close(file);
+#ifdef MADV_SEQUENTIAL
+					// Parsing mostly moves forward, read ahead aggressively and drop pages behind.
+					madvise(data, size, MADV_SEQUENTIAL);
+#endif
+					_mapping = data;
+					_view = { static_cast<const char*>(data), size };
+					return;
+				}
+			}
+
+			char chunk[16 * 1024];
+			for (;;) {
+				const auto numRead = ::read(file, chunk, sizeof(chunk));
+				if (numRead < 0) {
+					if (errno == EINTR)
+						continue;
+
+					const auto error = errno;
+					::close(file);
+					errno = error;
+					_fail("Gllpp: can't read " + path);
+				}
+				if (numRead == 0)
+					break;
+
+				_buffer.insert(_buffer.end(), chunk, chunk + numRead);
+			}
+			::close(file);
+#endif
+			_view = { _buffer.data(), _buffer.size() };
+		}
+
+		MappedFile(MappedFile&& other) noexcept
+			: _mapping(std::exchange(other._mapping, nullptr))
+			, _view(std::exchange(other._view, {}))
+			, _buffer(std::move(other._buffer)) {
+		}
+
+		MappedFile& operator=(MappedFile&& other) noexcept {
+			std::swap(_mapping, other._mapping);
+			std::swap(_view, other._view);
+			std::swap(_buffer, other._buffer);
+			return *this;
+		}
+
+		MappedFile(const MappedFile&) = delete;
+		MappedFile& operator=(const MappedFile&) = delete;
+
+		~MappedFile() {
+			if (_mapping == nullptr)
+				return;
+
+#ifdef _WIN32
+			UnmapViewOfFile(_mapping);
+#else
+			munmap(_mapping, _view.size());
+#endif
+		}
+
+		std::string_view view() const {
+			return _view;
+		}
+
+		/// Whether the contents are mapped rather than read into a buffer.
+		bool mapped() const {
+			return _mapping != nullptr;
+		}
+
+	private:
+		[[noreturn]] static void _fail(const std::string& what) {
+#ifdef _WIN32
+			throw std::system_error(static_cast<int>(GetLastError()), std::system_category(), what);
+#else
+			throw std::system_error(errno, std::generic_category(), what);
+#endif
+		}
+
+		void* _mapping = nullptr;
+		std::string_view _view;
+		std::vector<char> _buffer;
+	};
+
+	/// Read up to size bytes from the file descriptor into data, retrying reads that a signal interrupted. Returns 0 at
+	/// the end of the input. Throws std::system_error if the read fails.
+	inline size_t read_some(int descriptor, char* data, size_t size) {
+		for (;;) {
+#ifdef _WIN32
+			const auto numRead = ::_read(descriptor, data, static_cast<unsigned int>(std::min<size_t>(size, 1u << 30)));
+#else
+			const auto numRead = ::read(descriptor, data, size);
+#endif
+			if (numRead >= 0)
+				return static_cast<size_t>(numRead);
+			if (errno != EINTR)
+				throw std::system_error(errno, std::generic_category(), "Gllpp: can't read file descriptor");
+		}
+	}
+}
@@ -0,0 +1,297 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <bitset>
+#include <cstdint>
+#include <map>
+#include <optional>
+#include <string_view>
+#include <vector>
+
+namespace Gllpp {
+	/// Set of input symbols. Bits 0-255 are bytes, bit END stands for the end of the input.
+	using CharSet = std::bitset<257>;
+
+	constexpr size_t END = 256;
+
+	inline CharSet chars(std::string_view str) {
+		CharSet set;
+		for (auto c : str) {
+			set.set(static_cast<unsigned char>(c));
+		}
+		return set;
+	}
+
+	inline CharSet all_bytes() {
+		CharSet set;
+		set.set();
+		set.reset(END);
+		return set;
+	}
+
+
+
+
+
+	/// Nondeterministic automaton. Epsilon moves carry a guard on the next symbol, which is how greedy
+	/// constructs (layout skipping, Capture) are expressed: they may only be left when the next symbol
+	/// can't continue them.
+	class Nfa {
+	public:
+		struct Edge {
+			CharSet on;
+			uint32_t target;
+		};
+
+		struct Epsilon {
+			CharSet guard;
+			uint32_t target;
+		};
+
+		struct State {
+			std::vector<Edge> edges;
+			std::vector<Epsilon> epsilons;
+			int32_t accept = -1;
+		};
+
+		uint32_t add_state() {
+			_states.emplace_back();
+			return static_cast<uint32_t>(_states.size() - 1);
+		}
+
+		void add_edge(uint32_t from, CharSet on, uint32_t to) {
+			on.reset(END);
+			_states[from].edges.push_back({ on, to });
+		}
+
+		void add_epsilon(uint32_t from, uint32_t to, CharSet guard = CharSet{}.set()) {
+			_states[from].epsilons.push_back({ guard, to });
+		}
+
+		/// Lower kinds win if several accepting states are reached with the same input.
+		void set_accept(uint32_t state, int32_t kind) {
+			_states[state].accept = kind;
+		}
+
+		const std::vector<State>& states() const {
+			return _states;
+		}
+
+		size_t size() const {
+			return _states.size();
+		}
+
+	private:
+		std::vector<State> _states;
+	};
+
+
+
+
+
+	class Dfa {
+	public:
+		static constexpr uint32_t DEAD = UINT32_MAX;
+		static constexpr int32_t MORE = -2;
+
+		/// Subset construction followed by minimization. Returns nothing if more than maxStates states are needed.
+		static std::optional<Dfa> build(const Nfa& nfa, uint32_t start, size_t maxStates = 4096) {
+			Dfa dfa;
+			const auto representatives = dfa._partition(nfa);
+
+			using Kernel = std::vector<uint32_t>;
+			std::map<Kernel, uint32_t> ids;
+			std::vector<Kernel> kernels{ { start } };
+			ids[kernels[0]] = 0;
+
+			for (size_t i = 0; i < kernels.size(); ++i) {
+				for (size_t cls = 0; cls < dfa._numClasses; ++cls) {
+					const auto symbol = representatives[cls];
+					const auto closure = _closure(nfa, kernels[i], symbol);
+
+					int32_t accept = -1;
+					Kernel next;
+					for (auto state : closure) {
+						const auto& s = nfa.states()[state];
+						if (s.accept >= 0 && (accept < 0 || s.accept < accept))
+							accept = s.accept;
+
+						if (symbol == END)
+							continue;
+
+						for (auto& edge : s.edges) {
+							if (edge.on.test(symbol))
+								next.push_back(edge.target);
+						}
+					}
+					std::sort(next.begin(), next.end());
+					next.erase(std::unique(next.begin(), next.end()), next.end());
+
+					dfa._accept.push_back(accept);
+					if (next.empty()) {
+						dfa._next.push_back(DEAD);
+						continue;
+					}
+
+					auto it = ids.find(next);
+					if (it == ids.end()) {
+						if (kernels.size() >= maxStates)
+							return std::nullopt;
+
+						it = ids.emplace(next, static_cast<uint32_t>(kernels.size())).first;
+						kernels.push_back(next);
+					}
+					dfa._next.push_back(it->second);
+				}
+			}
+
+			dfa._minimize();
+			return dfa;
+		}
+
+		size_t state_count() const {
+			return _next.size() / _numClasses;
+		}
+
+		/// Where match() ran out of partial input: the state reached and the offset in str to continue at.
+		struct Suspension {
+			uint32_t state = 0;
+			size_t offset = 0;
+		};
+
+		/// Call f(length, kind) for every prefix of str the automaton accepts, shortest first. If str is partial, i.e.
+		/// may still grow, nothing is accepted at its end. The point to continue from is returned instead, unless the
+		/// automaton stopped before. examined is set to the number of symbols looked at, END included.
+		template<typename F>
+		std::optional<Suspension> match(std::string_view str, F f, bool partial = false, Suspension from = {}, size_t* examined = nullptr) const {
+			uint32_t state = from.state;
+			for (size_t i = from.offset;; ++i) {
+				if (i == str.size() && partial) {
+					if (examined != nullptr) {
+						*examined = i;
+					}
+					return Suspension{ state, i };
+				}
+
+				const auto cls = _classes[i < str.size() ? static_cast<unsigned char>(str[i]) : END];
+				const auto offset = state * _numClasses + cls;
+
+				if (_accept[offset] >= 0)
+					f(i, _accept[offset]);
+
+				state = i < str.size() ? _next[offset] : DEAD;
+				if (state == DEAD) {
+					if (examined != nullptr) {
+						*examined = i + 1;
+					}
+					return std::nullopt;
+				}
+			}
+		}
+
+		/// Longest accepted prefix as (length, kind), kind is -1 if nothing matched and MORE if a partial str has
+		/// to grow to tell.
+		std::pair<size_t, int32_t> longest(std::string_view str, bool partial = false) const {
+			std::pair<size_t, int32_t> best{ 0, -1 };
+			const auto suspension = match(str, [&](size_t length, int32_t kind) {
+				best = { length, kind };
+			}, partial);
+			return suspension ? std::make_pair(size_t{ 0 }, MORE) : best;
+		}
+
+	private:
+		/// Split all symbols into classes no CharSet of the automaton distinguishes. Returns one member per class.
+		std::vector<size_t> _partition(const Nfa& nfa) {
+			std::vector<const CharSet*> sets;
+			for (auto& state : nfa.states()) {
+				for (auto& edge : state.edges)
+					sets.push_back(&edge.on);
+				for (auto& epsilon : state.epsilons)
+					sets.push_back(&epsilon.guard);
+			}
+
+			std::map<std::vector<bool>, uint16_t> signatures;
+			std::vector<size_t> representatives;
+			for (size_t symbol = 0; symbol <= END; ++symbol) {
+				std::vector<bool> signature(sets.size() + 1);
+				for (size_t i = 0; i < sets.size(); ++i)
+					signature[i] = sets[i]->test(symbol);
+				signature[sets.size()] = symbol == END;
+
+				auto it = signatures.find(signature);
+				if (it == signatures.end()) {
+					it = signatures.emplace(signature, static_cast<uint16_t>(representatives.size())).first;
+					representatives.push_back(symbol);
+				}
+				_classes[symbol] = it->second;
+			}
+
+			_numClasses = representatives.size();
+			return representatives;
+		}
+
+		static std::vector<uint32_t> _closure(const Nfa& nfa, const std::vector<uint32_t>& kernel, size_t symbol) {
+			std::vector<uint32_t> closure = kernel;
+			std::vector<bool> seen(nfa.size());
+			for (auto state : kernel)
+				seen[state] = true;
+
+			for (size_t i = 0; i < closure.size(); ++i) {
+				for (auto& epsilon : nfa.states()[closure[i]].epsilons) {
+					if (!seen[epsilon.target] && epsilon.guard.test(symbol)) {
+						seen[epsilon.target] = true;
+						closure.push_back(epsilon.target);
+					}
+				}
+			}
+			return closure;
+		}
+
+		/// Moore partition refinement. State 0 stays the start state.
+		void _minimize() {
+			const auto numStates = state_count();
+			std::vector<uint32_t> block(numStates);
+
+			std::map<std::vector<int64_t>, uint32_t> blocks;
+			for (size_t changed = 1; changed;) {
+				blocks.clear();
+				std::vector<uint32_t> nextBlock(numStates);
+				for (size_t state = 0; state < numStates; ++state) {
+					std::vector<int64_t> signature{ block[state] };
+					for (size_t cls = 0; cls < _numClasses; ++cls) {
+						const auto next = _next[state * _numClasses + cls];
+						signature.push_back(_accept[state * _numClasses + cls]);
+						signature.push_back(next == DEAD ? -1 : block[next]);
+					}
+					nextBlock[state] = blocks.emplace(signature, static_cast<uint32_t>(blocks.size())).first->second;
+				}
+
+				changed = nextBlock != block;
+				block = nextBlock;
+			}
+
+			if (blocks.size() == numStates)
+				return;
+
+			std::vector<uint32_t> next(blocks.size() * _numClasses);
+			std::vector<int32_t> accept(blocks.size() * _numClasses);
+			for (size_t state = 0; state < numStates; ++state) {
+				for (size_t cls = 0; cls < _numClasses; ++cls) {
+					const auto target = _next[state * _numClasses + cls];
+					next[block[state] * _numClasses + cls] = target == DEAD ? DEAD : block[target];
+					accept[block[state] * _numClasses + cls] = _accept[state * _numClasses + cls];
+				}
+			}
+
+			// Blocks are numbered in order of first appearance, so the start state keeps number 0.
+			_next = std::move(next);
+			_accept = std::move(accept);
+		}
+
+		std::array<uint16_t, END + 1> _classes{};
+		size_t _numClasses = 0;
+		std::vector<uint32_t> _next;
+		std::vector<int32_t> _accept;
+	};
+}